@@ -0,0 +1,189 @@
+#include "mandelbrot.h"
+#include "multiwave.h"
+#include "colorize.h"
+#include <cstring>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace byteimage;
+
+//From shallow to deep, and from exterior-heavy to minibrot-heavy. Heights are the full view.
+//Don't change these; add new locations instead, so results stay comparable across builds.
+static const struct {
+  const char *name, *re, *im, *height;
+  int N;
+} locations[] = {
+  {"overview", "-0.5", "0", "3", 1000},
+  {"seahorse-1e-7", "-0.743643887037151", "0.131825904205330", "1e-7", 2000},
+  {"needle-1e-12", "-1.9999999999995", "0", "1e-12", 2000},
+  {"seahorse-1e-15", "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139", "1e-15", 20000},
+  {"seahorse-1e-24", "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139", "1e-24", 20000},
+  {"dendrite-1e-50", "0", "1", "1e-50", 3000},
+  {"minibrot-1e-46", "-1.99999999999999999999998775408187877626974572395292894510228233192639322895684", "0", "1e-46", 5000},
+  {"tip-1e-300", "-2", "0", "1e-300", 5000},
+  {"dendrite-1e-300", "0", "1", "1e-300", 5000},
+  {"dendrite-1e-500", "0", "1", "1e-500", 5000}
+};
+
+static void usage() {
+  fprintf(stderr,
+	  "Usage: newman-bench [options]\n"
+	  "Renders a fixed set of locations and writes JSON metrics to stdout.\n"
+	  "  -w width    Render width (default 160)\n"
+	  "  -h height   Render height (default 120)\n"
+	  "  -t n        Number of threads (default: all cores)\n"
+	  "  -p file     Palette for the recolor timing (default default.pal)\n"
+	  "  -l name     Only run locations whose name contains this\n"
+	  "  -a name     Force hardware, long-double, double-double or perturbation arithmetic\n"
+	  "  -V lanes    SIMD lanes for perturbation, 1 for scalar (default: widest supported)\n"
+	  "  -k n        Terms of the series approximation, 2 to 16 (default 3)\n"
+	  "  -B          Step every perturbation iteration, without BLA\n");
+}
+
+//Runs in its own process, so the peak memory belongs to this location alone
+static void bench(int index, int w, int h, int nthreads, Mandelbrot::Arithmetic arithmetic, int lanes, int order,
+		  bool bilinear, const CachedPalette& pal) {
+  const auto& location = locations[index];
+  Mandelbrot mandel(h, w);
+  HPComplex center, sz;
+  sz.re = mpf_class(location.height) / h;
+  sz.im = sz.re;
+  mandel.setView(center, sz);
+  mandel.center.re = location.re; //After setView, so they take the view's precision
+  mandel.center.im = location.im;
+  mandel.N = location.N;
+  mandel.forced_arithmetic = arithmetic;
+  if (lanes) mandel.lanes = lanes;
+  mandel.series_order = order;
+  mandel.bilinear = bilinear;
+
+  Clock::time_point start = Clock::now(), t = start;
+  mandel.precompute();
+  mandel.computeRows(nthreads);
+  double render_time = secondsSince(t);
+
+  t = Clock::now();
+  ByteImage img(h, w, 3);
+  for (int r = 0; r < h; r++)
+    colorLine(pal, true, mandel, 1, img, r);
+  mandel.stats.recolor_time = secondsSince(t);
+  double total_time = secondsSince(start);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  const RenderStats& stats = mandel.stats;
+  double compute_time = render_time - stats.probe_time - stats.series_time;
+  printf("    {\n"
+	 "      \"name\": \"%s\",\n"
+	 "      \"height\": \"%s\",\n"
+	 "      \"max_iterations\": %d,\n"
+	 "      \"arithmetic\": \"%s\",\n"
+	 "      \"lanes\": %d,\n"
+	 "      \"series_order\": %d,\n"
+	 "      \"bilinear\": %s,\n"
+	 "      \"reference_orbit_s\": %.6f,\n"
+	 "      \"series_s\": %.6f,\n"
+	 "      \"compute_s\": %.6f,\n"
+	 "      \"recolor_s\": %.6f,\n"
+	 "      \"total_s\": %.6f,\n"
+	 "      \"reference_length\": %d,\n"
+	 "      \"pixels\": %lld,\n"
+	 "      \"iterations\": %lld,\n"
+	 "      \"skipped_iterations\": %lld,\n"
+	 "      \"pixels_per_s\": %.1f,\n"
+	 "      \"iterations_per_s\": %.1f,\n"
+	 "      \"peak_rss_kb\": %ld,\n"
+	 "      \"stats\": ",
+	 location.name, location.height, mandel.N,
+	 Mandelbrot::arithmeticName(mandel.arithmetic()), mandel.lanes, mandel.series_order, mandel.bilinear? "true" : "false",
+	 stats.probe_time, stats.series_time, compute_time, stats.recolor_time, total_time,
+	 mandel.referenceLength(), stats.pixels(), stats.iterations, stats.skipped,
+	 stats.pixels() / compute_time, stats.iterations / compute_time,
+	 usage.ru_maxrss);
+  stats.write(stdout, "      ");
+  printf("\n    }");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  const char *palette_fn = "default.pal", *filter = "";
+  int w = 160, h = 120;
+  Mandelbrot::Arithmetic arithmetic = Mandelbrot::AUTO;
+  int lanes = 0, order = 3;
+  bool bilinear = true;
+  int nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:h:t:p:l:a:V:k:B")) != -1)
+    switch (opt) {
+    case 'w': w = atoi(optarg); break;
+    case 'h': h = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'p': palette_fn = optarg; break;
+    case 'l': filter = optarg; break;
+    case 'a':
+      while (arithmetic != Mandelbrot::PERTURBATION && strcmp(optarg, Mandelbrot::arithmeticName(arithmetic)))
+	arithmetic = (Mandelbrot::Arithmetic)(arithmetic + 1);
+      if (strcmp(optarg, Mandelbrot::arithmeticName(arithmetic))) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'V': lanes = atoi(optarg); break;
+    case 'k': order = atoi(optarg); break;
+    case 'B': bilinear = false; break;
+    default: usage(); return 1;
+    }
+  if (optind != argc || w < 1 || h < 1 || nthreads < 1 || lanes < 0 || order < 2 || order > max_series_order) {
+    usage();
+    return 1;
+  }
+
+  FILE* fp = fopen(palette_fn, "r");
+  if (!fp) {
+    fprintf(stderr, "Could not load from %s\n", palette_fn);
+    return 1;
+  }
+  fclose(fp);
+  MultiWaveGenerator mw;
+  mw.load_filename(palette_fn);
+
+  printf("{\n"
+	 "  \"width\": %d,\n"
+	 "  \"height\": %d,\n"
+	 "  \"threads\": %d,\n"
+	 "  \"hardware_threads\": %u,\n"
+	 "  \"compiler\": \"%s\",\n"
+	 "  \"locations\": [\n",
+	 w, h, nthreads, std::thread::hardware_concurrency(), __VERSION__);
+  fflush(stdout);
+
+  bool first = true, ok = true;
+  for (size_t i = 0; i < sizeof(locations) / sizeof(locations[0]); i++) {
+    if (!strstr(locations[i].name, filter)) continue;
+
+    fprintf(stderr, "%s\n", locations[i].name);
+    if (!first) printf(",\n");
+    fflush(stdout);
+    first = false;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      bench(i, w, h, nthreads, arithmetic, lanes, order, bilinear, mw.cache(locations[i].N));
+      _exit(0);
+    }
+
+    int status = 1;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || status) {
+      fprintf(stderr, "Benchmark %s failed\n", locations[i].name);
+      printf("    {\"name\": \"%s\", \"failed\": true}", locations[i].name);
+      ok = false;
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  return !ok;
+}
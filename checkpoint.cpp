@@ -0,0 +1,121 @@
+#include "checkpoint.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char checkpoint_magic[] = "newman-checkpoint 1";
+
+Checkpoint::Checkpoint(const std::string& dir) : dir(dir), fp(NULL), sc(1) { }
+
+Checkpoint::~Checkpoint() {
+  if (fp) fclose(fp);
+}
+
+std::string Checkpoint::jobPath() const {return dir + "/job.txt";}
+std::string Checkpoint::referencePath() const {return dir + "/reference.txt";}
+std::string Checkpoint::bandsPath() const {return dir + "/bands.dat";}
+
+static bool readHeader(FILE* fp, int& sc) {
+  char buf[256];
+  return (fgets(buf, sizeof(buf), fp) && !strncmp(buf, checkpoint_magic, strlen(checkpoint_magic))
+	  && fscanf(fp, "%d", &sc) == 1 && fgetc(fp) == '\n' && sc >= 1);
+}
+
+bool Checkpoint::exists() const {return !access(jobPath().c_str(), F_OK) && !access(bandsPath().c_str(), F_OK);}
+
+bool Checkpoint::create(const Mandelbrot& mandel, int sc, int band) {
+  if (fp) fclose(fp);
+  fp = NULL;
+  mkdir(dir.c_str(), 0777);
+  unlink(jobPath().c_str());
+  unlink(referencePath().c_str());
+
+  job = TileJob(mandel, band);
+  this->sc = sc;
+  done.assign(bands(), false);
+
+  if (!mandel.useHardware() && !mandel.saveReference(referencePath().c_str())) return false;
+  if (!(fp = fopen(bandsPath().c_str(), "w+b"))) return false;
+  fprintf(fp, "%s\n%d\n", checkpoint_magic, sc);
+  if (fflush(fp)) return false;
+
+  //The job goes last, so a checkpoint that exists has everything but its bands
+  std::string tmp = jobPath() + ".tmp";
+  return job.save(tmp.c_str()) && !rename(tmp.c_str(), jobPath().c_str());
+}
+
+bool Checkpoint::loadJob() {
+  FILE* fp = fopen(bandsPath().c_str(), "rb");
+  if (!fp) return false;
+  bool ok = readHeader(fp, sc);
+  fclose(fp);
+  return ok && job.load(jobPath().c_str());
+}
+
+bool Checkpoint::resume(Mandelbrot& mandel) {
+  if (fp) fclose(fp);
+  fp = NULL;
+  if (!loadJob()) return false;
+
+  mandel = job.view();
+  if (!access(referencePath().c_str(), F_OK) && !mandel.loadReference(referencePath().c_str())) return false;
+
+  if (!(fp = fopen(bandsPath().c_str(), "r+b"))) return false;
+  if (!readHeader(fp, sc)) {
+    fclose(fp);
+    fp = NULL;
+    return false;
+  }
+
+  //Everything after the last whole band is dropped, so new bands follow it directly
+  done.assign(bands(), false);
+  long end = ftell(fp);
+  char buf[256];
+  int i;
+  while (fgets(buf, sizeof(buf), fp) && sscanf(buf, "band %d", &i) == 1 && i >= 0 && i < bands()
+	 && mandel.readRows(fp, i * job.tile, std::min((i + 1) * job.tile, job.nr))) {
+    done[i] = true;
+    end = ftell(fp);
+  }
+  fseek(fp, end, SEEK_SET);
+  return !ftruncate(fileno(fp), end);
+}
+
+int Checkpoint::remaining() const {return std::count(done.begin(), done.end(), false);}
+
+bool Checkpoint::append(int i, const Mandelbrot& mandel) {
+  int r0 = i * job.tile;
+  fprintf(fp, "band %d\n", i);
+  return (mandel.writeRows(fp, r0, std::min(r0 + job.tile, job.nr))
+	  && !fflush(fp) && !fsync(fileno(fp)));
+}
+
+bool Checkpoint::render(Mandelbrot& mandel, int nthreads, const std::function<bool(int)>& progress) {
+  if (!fp) return false;
+
+  int rows = 0;
+  for (int i = 0; i < bands(); i++)
+    if (done[i]) rows += std::min(job.tile, job.nr - i * job.tile);
+
+  for (int i = 0; i < bands(); i++) {
+    if (done[i]) continue;
+
+    int r0 = i * job.tile, r1 = std::min(r0 + job.tile, job.nr);
+    if (!mandel.computeRows(r0, r1, nthreads, [&](int n) {return !progress || progress(rows + n);})
+	|| !append(i, mandel))
+      return false;
+    done[i] = true;
+    rows += r1 - r0;
+  }
+  return true;
+}
+
+void Checkpoint::remove() {
+  if (fp) fclose(fp);
+  fp = NULL;
+  unlink(bandsPath().c_str());
+  unlink(referencePath().c_str());
+  unlink(jobPath().c_str());
+  rmdir(dir.c_str());
+}
@@ -0,0 +1,58 @@
+#ifndef _BPJ_NEWMAN_CHECKPOINT_H
+#define _BPJ_NEWMAN_CHECKPOINT_H
+
+#include "tiles.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+constexpr int checkpoint_band = 32; //Rows
+
+/*
+ * A render saved as it goes, so a killed one can be resumed. The directory holds the view (as
+ * a tile job whose tile is the band height) and the reference orbit, both written once, and
+ * an append-only file of finished bands of rows, each flushed to disk as it completes. A band
+ * cut short by a crash fails its length check, is cut off and is rendered again.
+ */
+
+class Checkpoint {
+protected:
+  std::string dir;
+  FILE* fp; //Bands, for appending
+  std::vector<bool> done;
+
+  std::string jobPath() const;
+  std::string referencePath() const;
+  std::string bandsPath() const;
+  bool append(int i, const Mandelbrot& mandel);
+
+public:
+  TileJob job;
+  int sc; //Multisampling, for the image the grid becomes
+
+  Checkpoint(const std::string& dir);
+  ~Checkpoint();
+
+  Checkpoint(const Checkpoint&) = delete;
+  Checkpoint& operator=(const Checkpoint&) = delete;
+
+  bool exists() const; //Whether there is a render to resume
+  bool loadJob();      //Just the job and sc, to see what a resume would render
+
+  //Starts over, for a view that has been precomputed
+  bool create(const Mandelbrot& mandel, int sc, int band);
+
+  //Sets up the view with its reference orbit and fills in the bands already rendered
+  bool resume(Mandelbrot& mandel);
+
+  inline int bands() const {return job.tilesDown();}
+  int remaining() const;
+
+  //Renders and appends each missing band. progress gets rows done of the whole view,
+  //between rows, and may cancel. Returns false if cancelled or a band could not be saved.
+  bool render(Mandelbrot& mandel, int nthreads, const std::function<bool(int)>& progress = nullptr);
+
+  void remove(); //Once the render is saved
+};
+
+#endif
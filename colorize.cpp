@@ -0,0 +1,41 @@
+#include "colorize.h"
+#include <byteimage/types.h>
+
+using namespace byteimage;
+
+Color getColor(const CachedPalette& pal, bool smooth, int N, const RenderGrid::EscapeValue& escape) {
+  if (escape.iterations >= N) return Color(0);
+  else if (!smooth) return pal[escape.iterations];
+  else return interp(pal[escape.iterations - 1],
+		     pal[escape.iterations],
+		     escape.smoothing);
+}
+
+void colorLine(const CachedPalette& pal, bool smooth, const Mandelbrot& mandel, int sc, ByteImage& img, int r) {
+  Color color;
+
+  if (sc == 1) {
+    for (int c = 0; c < img.nc; c++) {
+      color = getColor(pal, smooth, mandel.N, mandel.at(r, c));
+      
+      img.at(r, c, 0) = color.r;
+      img.at(r, c, 1) = color.g;
+      img.at(r, c, 2) = color.b;
+    }
+  }
+  else {
+    Pt3f rgb;
+    for (int c = 0; c < img.nc; c++) {
+      rgb = Pt3f();
+      for (int r1 = r * sc; r1 < (r + 1) * sc; r1++)
+	for (int c1 = c * sc; c1 < (c + 1) * sc; c1++) {
+	  color = getColor(pal, smooth, mandel.N, mandel.at(r1, c1));
+	  rgb.x += color.r; rgb.y += color.g; rgb.z += color.b;
+	}
+      rgb = rgb / (sc * sc);
+      img.at(r, c, 0) = clip(rgb.x);
+      img.at(r, c, 1) = clip(rgb.y);
+      img.at(r, c, 2) = clip(rgb.z);
+    }
+  }
+}
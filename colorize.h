@@ -0,0 +1,17 @@
+#ifndef _BPJ_NEWMAN_COLORIZE_H
+#define _BPJ_NEWMAN_COLORIZE_H
+
+#include "mandelbrot.h"
+#include <byteimage/byteimage.h>
+#include <byteimage/palette.h>
+
+using byteimage::ByteImage;
+using byteimage::CachedPalette;
+using byteimage::Color;
+
+Color getColor(const CachedPalette& pal, bool smooth, int N, const RenderGrid::EscapeValue& escape);
+
+//Colors row r of img, averaging sc x sc samples of mandel per pixel
+void colorLine(const CachedPalette& pal, bool smooth, const Mandelbrot& mandel, int sc, ByteImage& img, int r);
+
+#endif
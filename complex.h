@@ -2,6 +2,10 @@
 #define _BPJ_NEWMAN_COMPLEX_H
 
 #include <gmpxx.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 
 class LPComplex {
 public:
@@ -11,11 +15,36 @@ public:
   constexpr LPComplex(double re, double im) : re(re), im(im) { }
 };
 
+//Every value carries its own precision: nothing relies on GMP's process-wide default
 class HPComplex {
 public:
   mpf_class re, im;
+
+  HPComplex() { }
+  explicit HPComplex(mp_bitcnt_t bits) : re(0, bits), im(0, bits) { }
 };
 
+//In hexadecimal with a decimal exponent, for reading back with base -16. Unlike mpf_out_str,
+//which rounds to the nominal precision, this writes every limb, so the value comes back exact.
+inline void writeHex(FILE* fp, const mpf_class& v) {
+  const __mpf_struct* f = v.get_mpf_t();
+  int size = std::abs(f->_mp_size), digits = mp_bits_per_limb / 4;
+  if (!size) {
+    fprintf(fp, "0");
+    return;
+  }
+  fprintf(fp, "%s0.", f->_mp_size < 0? "-" : "");
+  for (int i = size - 1; i >= 0; i--)
+    gmp_fprintf(fp, "%0*Mx", digits, f->_mp_d[i]);
+  fprintf(fp, "@%ld", (long)f->_mp_exp * digits);
+}
+
+//Four bits per digit holds whatever writeHex wrote
+inline bool readHex(mpf_class& v, const char* str) {
+  v.set_prec(std::max((size_t)64, 4 * strlen(str)));
+  return !v.set_str(str, -16);
+}
+
 constexpr LPComplex sq(const LPComplex& a) {
   return LPComplex(a.re * a.re - a.im * a.im, 2.0 * a.re * a.im);
 }
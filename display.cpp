@@ -29,7 +29,7 @@ void MyDisplay::render() {
   osd.draw(canvas);
 }
   
-MyDisplay::MyDisplay() : WidgetDisplay(600, 800, "NewMandel"), font("res/FreeSans.ttf", 20) {
+MyDisplay::MyDisplay(int h, int w) : WidgetDisplay(h, w, "NewMandel"), font("res/FreeSans.ttf", 20) {
   fractal = new FractalViewer(this, canvas.nr, canvas.nc);
   editor = new Editor(this);
 
@@ -106,6 +106,16 @@ void MyDisplay::openPalette() {
 }
 
 int main(int argc, char* argv[]) {
-  MyDisplay().main();
+  if (argc != 1 && argc != 3) {
+    fprintf(stderr, "Usage: newman [width height]\n");
+    return 1;
+  }
+  int w = (argc == 3)? atoi(argv[1]) : 800, h = (argc == 3)? atoi(argv[2]) : 600;
+  if (w < 160 || h < 120) {
+    fprintf(stderr, "The window must be at least 160x120\n");
+    return 1;
+  }
+  
+  MyDisplay(h, w).main();
   return 0;
 }
@@ -23,7 +23,7 @@ public:
   FractalViewer* fractal;
   Editor* editor;
   
-  MyDisplay();  
+  MyDisplay(int h = 600, int w = 800);
   ~MyDisplay();
 
   bool forceUpdate();
@@ -0,0 +1,68 @@
+#ifndef _BPJ_NEWMAN_DOUBLEDOUBLE_H
+#define _BPJ_NEWMAN_DOUBLEDOUBLE_H
+
+#include <gmpxx.h>
+#include <cmath>
+
+/*
+ * Unevaluated sum of two doubles, good for about 106 bits of mantissa. Only what the
+ * escape-time loop needs: add, subtract, multiply.
+ */
+
+class DoubleDouble {
+protected:
+  static inline DoubleDouble quickTwoSum(double a, double b) {
+    double s = a + b;
+    return DoubleDouble(s, b - (s - a));
+  }
+
+  static inline DoubleDouble twoSum(double a, double b) {
+    double s = a + b, bb = s - a;
+    return DoubleDouble(s, (a - (s - bb)) + (b - bb));
+  }
+
+  static inline DoubleDouble twoProd(double a, double b) {
+    double p = a * b;
+#ifdef __FMA__
+    return DoubleDouble(p, std::fma(a, b, -p));
+#else
+    //Dekker's product; without FMA hardware the compiler can't contract these
+    const double split = 134217729.0; //2^27 + 1
+    double t = split * a, ah = t - (t - a), al = a - ah;
+    t = split * b;
+    double bh = t - (t - b), bl = b - bh;
+    return DoubleDouble(p, ((ah * bh - p) + ah * bl + al * bh) + al * bl);
+#endif
+  }
+
+public:
+  double hi, lo;
+
+  DoubleDouble() : hi(0.0), lo(0.0) { }
+  DoubleDouble(double hi, double lo = 0.0) : hi(hi), lo(lo) { }
+  DoubleDouble(const mpf_class& x) {
+    hi = x.get_d();
+    mpf_class rest = x - hi;
+    lo = rest.get_d();
+  }
+
+  inline DoubleDouble operator+(const DoubleDouble& b) const {
+    DoubleDouble s = twoSum(hi, b.hi);
+    return quickTwoSum(s.hi, s.lo + lo + b.lo);
+  }
+
+  inline DoubleDouble operator-() const {return DoubleDouble(-hi, -lo);}
+  inline DoubleDouble operator-(const DoubleDouble& b) const {return *this + (-b);}
+
+  inline DoubleDouble operator*(const DoubleDouble& b) const {
+    DoubleDouble p = twoProd(hi, b.hi);
+    return quickTwoSum(p.hi, p.lo + hi * b.lo + lo * b.hi);
+  }
+
+  inline DoubleDouble twice() const {return DoubleDouble(2.0 * hi, 2.0 * lo);}
+  inline double toDouble() const {return hi;}
+};
+
+inline DoubleDouble twice(const DoubleDouble& x) {return x.twice();}
+
+#endif
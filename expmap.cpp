@@ -0,0 +1,188 @@
+#include "expmap.h"
+#include <cmath>
+#include <cstring>
+
+constexpr double tau = 2.0 * 3.14159265358979323846;
+constexpr char magic[] = "NEWMAN-EXPMAP 1";
+
+double logOf(const mpf_class& v) {
+  signed long int e;
+  double m = mpf_get_d_2exp(&e, v.get_mpf_t());
+  return log(fabs(m)) + e * log(2.0);
+}
+
+static mpf_class expOf(double logv, int bits) {
+  double l2 = logv / log(2.0);
+  long e = (long)floor(l2);
+  mpf_class v(pow(2.0, l2 - e), bits);
+  if (e >= 0) mpf_mul_2exp(v.get_mpf_t(), v.get_mpf_t(), e);
+  else mpf_div_2exp(v.get_mpf_t(), v.get_mpf_t(), -e);
+  return v;
+}
+
+ExpMap::ExpMap() : fp(NULL), data_offset(0), next_row(0), window_row(0), N(0), nr(0), nc(0), log_outer(0.0), step(0.0) { }
+
+ExpMap::ExpMap(const HPComplex& center, int N, int nc, double log_outer, double log_inner) : ExpMap() {
+  this->center.re.set_prec(center.re.get_prec());
+  this->center.im.set_prec(center.im.get_prec());
+  this->center.re = center.re;
+  this->center.im = center.im;
+  this->N = N;
+  this->nc = nc;
+  this->log_outer = log_outer;
+  step = tau / nc;
+  nr = (int)ceil((log_outer - log_inner) / step) + 1;
+}
+
+ExpMap::~ExpMap() {close();}
+
+bool ExpMap::create(const char* fn) {
+  close();
+  fp = fopen(fn, "wb");
+  if (!fp) return false;
+
+  fprintf(fp, "%s\n%d %d %d\n%.17g %.17g\n", magic, N, nr, nc, log_outer, step);
+  mpf_out_str(fp, 10, 0, center.re.get_mpf_t());
+  fprintf(fp, "\n");
+  mpf_out_str(fp, 10, 0, center.im.get_mpf_t());
+  fprintf(fp, "\n");
+  
+  data_offset = ftell(fp);
+  next_row = 0;
+  return true;
+}
+
+bool ExpMap::renderBand() {
+  if (!fp || next_row >= nr) return false;
+
+  //Each band covers a factor of two in radius, rendered at the pixel size of its inner edge
+  int r0 = next_row;
+  int r1 = std::min(nr, r0 + (int)ceil(log(2.0) / step));
+  double log_pixel = logRadius(r1 - 1) + log(step);
+  int n = (int)ceil(2.0 * exp(logRadius(r0) - log_pixel)) + 2;
+
+  int bits = (int)(64 - log_pixel / log(2.0));
+  HPComplex sz;
+  sz.re = sz.im = expOf(log_pixel, bits);
+
+  Mandelbrot engine(n, n);
+  engine.N = N;
+  engine.setView(center, sz);
+  engine.precompute();
+
+  HPComplex pt(engine.precision());
+  std::vector<RenderGrid::EscapeValue> row(nc);
+  double k, theta;
+  for (int r = r0; r < r1; r++) {
+    k = exp(logRadius(r) - log_pixel);
+    for (int c = 0; c < nc; c++) {
+      theta = (c + 0.5) * step;
+      pt.re = engine.center.re + engine.sz.re * (k * cos(theta));
+      pt.im = engine.center.im + engine.sz.im * (k * sin(theta));
+      row[c] = engine.computePoint(pt);
+    }
+    fwrite(row.data(), sizeof(RenderGrid::EscapeValue), nc, fp);
+  }
+  fflush(fp);
+  
+  next_row = r1;
+  return true;
+}
+
+bool ExpMap::open(const char* fn) {
+  close();
+  fp = fopen(fn, "rb");
+  if (!fp) return false;
+
+  char buf[1024];
+  if (!fgets(buf, sizeof(buf), fp) || strncmp(buf, magic, strlen(magic))
+      || fscanf(fp, "%d %d %d\n%lf %lf\n", &N, &nr, &nc, &log_outer, &step) != 5) {
+    close();
+    return false;
+  }
+
+  int bits = (int)(64 - (logRadius(nr) + log(step)) / log(2.0));
+  center.re.set_prec(bits);
+  center.im.set_prec(bits);
+  fscanf(fp, "%s\n", buf); center.re = buf;
+  fscanf(fp, "%s\n", buf); center.im = buf;
+  
+  data_offset = ftell(fp);
+  next_row = nr;
+  window = RenderGrid();
+  window_row = 0;
+  return true;
+}
+
+void ExpMap::close() {
+  if (fp) fclose(fp);
+  fp = NULL;
+}
+
+void ExpMap::loadRows(int r0, int r1) {
+  if (r0 >= window_row && r1 < window_row + window.nr) return;
+
+  RenderGrid next(r1 - r0 + 1, nc);
+  for (int r = r0; r <= r1; r++) {
+    if (r >= window_row && r < window_row + window.nr)
+      std::copy(&window.at(r - window_row, 0), &window.at(r - window_row, 0) + nc, &next.at(r - r0, 0));
+    else {
+      fseek(fp, data_offset + (long)r * nc * sizeof(RenderGrid::EscapeValue), SEEK_SET);
+      fread(&next.at(r - r0, 0), sizeof(RenderGrid::EscapeValue), nc, fp);
+    }
+  }
+
+  window = std::move(next);
+  window_row = r0;
+}
+
+double ExpMap::logStart(int frame_nr, int frame_nc) const {
+  return log_outer - log(0.5 * sqrt((double)frame_nr * frame_nr + (double)frame_nc * frame_nc));
+}
+
+double ExpMap::logEnd() const {return logRadius(nr - 1) - log(0.5);}
+
+void ExpMap::frame(double log_pixel, RenderGrid& frame) {
+  double rmax = 0.5 * sqrt((double)frame.nr * frame.nr + (double)frame.nc * frame.nc);
+  int r0 = std::max(0, (int)floor((log_outer - log(rmax) - log_pixel) / step));
+  int r1 = std::min(nr - 1, (int)ceil((log_outer - log(0.5) - log_pixel) / step) + 1);
+  loadRows(r0, r1);
+  
+  double dx, dy, fr, fc, tr, tc, v;
+  int ir, ic, ir1, ic1;
+  for (int r = 0; r < frame.nr; r++)
+    for (int c = 0; c < frame.nc; c++) {
+      dx = c - frame.nc / 2;
+      dy = frame.nr / 2 - r - 1;
+      
+      fr = (log_outer - 0.5 * log(std::max(dx * dx + dy * dy, 0.25)) - log_pixel) / step;
+      fc = atan2(dy, dx) / step - 0.5;
+      if (fc < 0.0) fc += nc;
+
+      fr = std::min(std::max(fr, (double)r0), (double)r1);
+      ir = std::min((int)fr, r1 - 1);
+      ic = (int)fc % nc;
+      tr = fr - ir;
+      tc = fc - (int)fc;
+      ir1 = std::min(ir + 1, r1);
+      ic1 = (ic + 1) % nc;
+      ir -= window_row;
+      ir1 -= window_row;
+
+      const RenderGrid::EscapeValue& e00 = window.at(ir, ic);
+      const RenderGrid::EscapeValue& e01 = window.at(ir, ic1);
+      const RenderGrid::EscapeValue& e10 = window.at(ir1, ic);
+      const RenderGrid::EscapeValue& e11 = window.at(ir1, ic1);
+
+      //Interior samples don't blend; take the nearest one instead
+      if (e00.iterations >= N || e01.iterations >= N || e10.iterations >= N || e11.iterations >= N) {
+	frame.at(r, c) = (tr < 0.5)? ((tc < 0.5)? e00 : e01) : ((tc < 0.5)? e10 : e11);
+	continue;
+      }
+
+      v = (1.0 - tr) * ((1.0 - tc) * (e00.iterations + e00.smoothing) + tc * (e01.iterations + e01.smoothing))
+	+ tr * ((1.0 - tc) * (e10.iterations + e10.smoothing) + tc * (e11.iterations + e11.smoothing));
+      frame.at(r, c).iterations = (int)v;
+      frame.at(r, c).smoothing = v - (int)v;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef _BPJ_NEWMAN_EXPMAP_H
+#define _BPJ_NEWMAN_EXPMAP_H
+
+#include "mandelbrot.h"
+#include <cstdio>
+
+/*
+ * Exponential map of a zoom around a fixed center: columns are angle (one full
+ * turn), rows are log radius running inward. Each row steps log radius by the
+ * same amount as one column steps angle, so samples are square. Zoom frames at
+ * any scale are resampled from the strip, which is streamed to disk by bands.
+ */
+
+class ExpMap {
+protected:
+  FILE* fp;
+  long data_offset;
+  int next_row;
+
+  //Rows kept in memory while resampling
+  RenderGrid window;
+  int window_row;
+
+  void loadRows(int r0, int r1);
+  
+public:
+  HPComplex center;
+  int N;
+  int nr, nc;
+  double log_outer; //Log radius of row 0
+  double step;      //Log radius per row, equal to angle per column
+
+  ExpMap();
+  ExpMap(const HPComplex& center, int N, int nc, double log_outer, double log_inner);
+  ~ExpMap();
+
+  ExpMap(const ExpMap&) = delete;
+  ExpMap& operator=(const ExpMap&) = delete;
+
+  inline double logRadius(double r) const {return log_outer - r * step;}
+  inline int rowsDone() const {return next_row;}
+
+  //Writing
+  bool create(const char* fn);
+  bool renderBand(); //Returns false once all rows have been written
+
+  //Reading
+  bool open(const char* fn);
+  void close();
+  
+  double logStart(int frame_nr, int frame_nc) const; //Log pixel size of the first frame that fits
+  double logEnd() const;                             //Log pixel size of the deepest frame
+  void frame(double log_pixel, RenderGrid& frame);
+};
+
+double logOf(const mpf_class& v);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _BPJ_NEWMAN_FLOATEXP_H
+#define _BPJ_NEWMAN_FLOATEXP_H
+
+#include "complex.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * A double's mantissa with an exponent of its own, for values far outside double range
+ * that never need more than 53 bits: mantissa in [0.5, 1) or zero. Only what the series
+ * needs: add, multiply, and conversion back to double.
+ */
+
+class FloatExp {
+protected:
+  //m * 2^e for any finite m, by moving m's exponent into e
+  static inline FloatExp normalize(double m, long e) {
+    uint64_t bits;
+    memcpy(&bits, &m, sizeof(bits));
+    int biased = (bits >> 52) & 0x7ff;
+    if (!biased) return FloatExp(); //Products and sums of mantissas are never subnormal
+    bits = (bits & ~(0x7ffULL << 52)) | (1022ULL << 52);
+    memcpy(&m, &bits, sizeof(m));
+    return FloatExp(m, e + biased - 1022);
+  }
+
+  static inline double twoTo(long e) { //For -1022 <= e <= 1023
+    uint64_t bits = (uint64_t)(e + 1023) << 52;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+  }
+
+  FloatExp(double m, long e) : m(m), e(e) { }
+
+public:
+  double m;
+  long e;
+
+  FloatExp() : m(0.0), e(0) { }
+  FloatExp(double x) {*this = normalize(x, 0);}
+
+  inline FloatExp operator*(const FloatExp& b) const {return normalize(m * b.m, e + b.e);}
+
+  inline FloatExp operator+(const FloatExp& b) const {
+    if (!m) return b;
+    if (!b.m) return *this;
+    long d = e - b.e;
+    if (d > 60) return *this;
+    if (d < -60) return b;
+    if (d >= 0) return normalize(m + b.m * twoTo(-d), e);
+    return normalize(m * twoTo(d) + b.m, b.e);
+  }
+
+  inline FloatExp operator-() const {return FloatExp(-m, e);}
+  inline FloatExp operator-(const FloatExp& b) const {return *this + (-b);}
+
+  //Saturates to infinity or zero outside double range
+  inline double toDouble() const {
+    if (!m || e < -1100) return 0.0;
+    if (e > 1100) return m * HUGE_VAL;
+    return (m * twoTo(e / 2)) * twoTo(e - e / 2);
+  }
+};
+
+class FEComplex {
+public:
+  FloatExp re, im;
+
+  FEComplex() { }
+  FEComplex(const FloatExp& re, const FloatExp& im) : re(re), im(im) { }
+  FEComplex(const LPComplex& z) : re(z.re), im(z.im) { }
+};
+
+inline FEComplex operator+(const FEComplex& a, const FEComplex& b) {return FEComplex(a.re + b.re, a.im + b.im);}
+
+inline FEComplex operator*(const FEComplex& a, const FEComplex& b) {
+  return FEComplex(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
+}
+
+inline LPComplex descend(const FEComplex& a) {return LPComplex(a.re.toDouble(), a.im.toDouble());}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _BPJ_NEWMAN_FORMULA_H
+#define _BPJ_NEWMAN_FORMULA_H
+
+#include "complex.h"
+#include <cmath>
+
+constexpr double bailout = 1024.0; //For every escape-time loop
+constexpr double bailout2 = bailout * bailout;
+
+constexpr int max_power = 5; //Every kernel is instantiated for powers 2 through this
+
+constexpr int binomial(int n, int k) {return k? binomial(n, k - 1) * (n - k + 1) / k : 1;}
+
+inline double twice(double x) {return 2.0 * x;}
+inline long double twice(long double x) {return 2.0 * x;}
+inline mpf_class twice(const mpf_class& x) {return 2.0 * x;}
+
+/*
+ * z -> z^D + c. The kernels are templates over the formula, so each render runs loops
+ * compiled for its own power, and D == 2 costs exactly what it did before there was a choice.
+ * Real is anything with +, - and *, from double to mpf_class; for the perturbation step it
+ * may also be a GCC vector of doubles.
+ */
+
+template <int D>
+class Multibrot {
+public:
+  static constexpr int power = D;
+  static constexpr bool series = (D == 2);   //computeSeries derives the series for z^2 only
+  static constexpr bool cardioid = (D == 2); //Main cardioid and period-2 disk
+
+  template <typename Real>
+  static inline void step(Real& x, Real& y, const Real& x0, const Real& y0) {
+    if (D == 2) {
+      Real x2 = x * x, y2 = y * y;
+      y = twice(x * y) + y0;
+      x = x2 - y2 + x0;
+      return;
+    }
+
+    Real zr = x, zi = y, t = x; //Copies, so an mpf_class t takes x's precision
+    for (int k = 1; k < D; k++) {
+      t = zr * x - zi * y;
+      zi = zr * y + zi * x;
+      zr = t;
+    }
+    x = zr + x0;
+    y = zi + y0;
+  }
+
+  //High precision, into a separate value so gmpxx can build z^2 without temporaries
+  static inline void step(const HPComplex& z, const HPComplex& c, HPComplex& next) {
+    if (D == 2) {
+      next.re = z.re * z.re - z.im * z.im + c.re;
+      next.im = 2.0 * (z.re * z.im) + c.im;
+      return;
+    }
+
+    next.re = z.re;
+    next.im = z.im;
+    step(next.re, next.im, c.re, c.im);
+  }
+
+  //d -> (X + d)^D - X^D + d0, expanded so no term is the difference of two large values
+  template <typename Real>
+  static inline void perturb(const Real& xr, const Real& xi, Real& dr, Real& di, const Real& d0r, const Real& d0i) {
+    Real tr, ti;
+    if (D == 2) {
+      tr = 2.0 * (xr * dr - xi * di) + (dr * dr - di * di) + d0r;
+      ti = 2.0 * (xr * di + xi * dr + dr * di) + d0i;
+      dr = tr;
+      di = ti;
+      return;
+    }
+
+    //Horner's rule in d over the binomial expansion, from the d^D term down
+    Real pr[D], pi[D], sr = dr, si = di;
+    pr[1] = xr; pi[1] = xi;
+    for (int j = 2; j < D; j++) {
+      pr[j] = pr[j - 1] * xr - pi[j - 1] * xi;
+      pi[j] = pr[j - 1] * xi + pi[j - 1] * xr;
+    }
+    for (int k = D - 1; k >= 1; k--) {
+      tr = (double)binomial(D, k) * pr[D - k] + sr;
+      ti = (double)binomial(D, k) * pi[D - k] + si;
+      sr = tr * dr - ti * di;
+      si = tr * di + ti * dr;
+    }
+    dr = sr + d0r;
+    di = si + d0i;
+  }
+
+  //Fractional iteration count from the first value past the bailout
+  static inline double smoothing(const LPComplex& z) {
+    double v = 0.5 * log(sqMag(z)) / log(bailout);
+    return 1.0 - ((D == 2)? log2(v) : log(v) / log((double)D));
+  }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include "mandelbrot.h"
+#include "multiwave.h"
+#include "colorize.h"
+#include "tiles.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include <chrono>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace byteimage;
+
+static bool exists(const char* fn) {
+  FILE* fp = fopen(fn, "r");
+  if (fp) fclose(fp);
+  return fp != NULL;
+}
+
+static void usage() {
+  fprintf(stderr,
+	  "Usage: newman-render [options] location\n"
+	  "       newman-render -c dir [options]\n"
+	  "  location    File saved with F2, or in the newman-location format\n"
+	  "  -o file     Write a PNG (default render.png unless -e is given)\n"
+	  "  -e file     Write raw escape data\n"
+	  "  -J file     Write render statistics as JSON\n"
+	  "  -P file     Write a timeline of render phases in Chrome trace-event JSON\n"
+	  "  -w width    Output width (default 1920)\n"
+	  "  -h height   Output height (default 1080)\n"
+	  "  -s n        n x n multisampling (default 1)\n"
+	  "  -t n        Number of threads (default: all cores)\n"
+	  "  -n n        Iteration count (default: from location)\n"
+	  "  -A max      Choose the iteration count from a coarse render, up to max\n"
+	  "  -k n        Terms of the series approximation, 2 to 16 (default 3)\n"
+	  "  -p file     Palette (default default.pal)\n"
+	  "  -S          Disable smoothing\n"
+	  "  -r dir      Keep slow reference orbits in dir, and start from one there that fits\n"
+	  "  -c dir      Checkpoint to dir as bands of rows finish, or resume the render there,\n"
+	  "              keeping its view, size and iterations\n"
+	  "Distributed rendering over a shared directory:\n"
+	  "  -C dir      Coordinate: split the view into tiles and stitch the results\n"
+	  "  -j n        Spawn n local workers while coordinating (default 0)\n"
+	  "  -T n        Tile size in samples (default 256)\n"
+	  "  -R seconds  Requeue tiles whose worker has been silent this long (default 60)\n"
+	  "  -W dir      Work: render tiles from dir until its coordinator finishes\n");
+}
+
+static bool saveTrace(const char* fn) {
+  if (Trace::stop(fn)) {
+    fprintf(stderr, "Saved trace to %s\n", fn);
+    return true;
+  }
+  fprintf(stderr, "Could not save to %s\n", fn);
+  return false;
+}
+
+static int work(const char* dir, int nthreads) {
+  TileQueue queue(dir);
+  TileJob job;
+  while (!job.load(queue.jobPath().c_str())) {
+    if (queue.finished()) return 0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  Mandelbrot reference;
+  reference.power = job.power; //Not in the file, but the approximations built from it depend on it
+  bool perturbation = reference.loadReference(queue.referencePath().c_str());
+  fprintf(stderr, "Working on %s (%d tiles, %s arithmetic)\n", dir, job.count(), perturbation? "perturbation" : "hardware");
+
+  int i, count = 0;
+  while (!queue.finished()) {
+    if (!queue.claim(i)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      continue;
+    }
+
+    TraceSpan span("tile", "tile", i);
+    Clock::time_point t = Clock::now(), beat = t;
+    Mandelbrot tile = job.engine(i);
+    if (perturbation) tile.setReference(reference);
+    tile.computeRows(nthreads, [&](int) {
+	if (secondsSince(beat) > 1.0) {
+	  queue.heartbeat(i);
+	  beat = Clock::now();
+	}
+	return true;
+      });
+    
+    if (queue.submit(i, tile)) {
+      fprintf(stderr, "Tile %d: %.3fs\n", i, secondsSince(t));
+      count++;
+    }
+    else fprintf(stderr, "Could not submit tile %d\n", i);
+  }
+
+  fprintf(stderr, "Rendered %d tiles\n", count);
+  return 0;
+}
+
+static bool coordinate(const char* dir, Mandelbrot& mandel, int tile, int nworkers, int nthreads, double timeout, const char* self) {
+  TileQueue queue(dir);
+  TileJob job(mandel, tile);
+  if (!queue.create(job, mandel.useHardware()? NULL : &mandel)) {
+    fprintf(stderr, "Could not create a tile queue in %s\n", dir);
+    return false;
+  }
+
+  //This very binary, wherever it was started from; argv[0] is only a fallback, searched for in PATH
+  char exe[4096];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  exe[std::max(len, (ssize_t)0)] = 0;
+  
+  std::vector<pid_t> workers;
+  std::string threads = std::to_string(nthreads);
+  for (int i = 0; i < nworkers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (len > 0) execl(exe, self, "-W", dir, "-t", threads.c_str(), (char*)NULL);
+      execlp(self, self, "-W", dir, "-t", threads.c_str(), (char*)NULL);
+      _exit(1);
+    }
+    else if (pid > 0) workers.push_back(pid);
+  }
+
+  int done = 0, requeued;
+  while (done < job.count()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    //Workers only exit once the queue is finished, so any that has already died failed
+    for (auto it = workers.begin(); it != workers.end();) {
+      if (waitpid(*it, NULL, WNOHANG) == *it) it = workers.erase(it);
+      else ++it;
+    }
+    if (nworkers && workers.empty()) {
+      for (done = 0; done < job.count() && queue.isDone(done);) done++;
+      if (done < job.count()) {
+	fprintf(stderr, "\nEvery worker exited with tiles left to render\n");
+	queue.markDone();
+	return false;
+      }
+    }
+    
+    if ((requeued = queue.requeueStale(timeout)))
+      fprintf(stderr, "\nRequeued %d stale tiles\n", requeued);
+    
+    for (done = 0; done < job.count() && queue.isDone(done);) done++;
+    if (done < job.count()) {
+      int count = 0;
+      for (int i = 0; i < job.count(); i++)
+	count += queue.isDone(i);
+      fprintf(stderr, "\rRendered tile %d / %d", count, job.count());
+    }
+  }
+  fprintf(stderr, "\rRendered tile %d / %d\n", job.count(), job.count());
+
+  bool ok = true;
+  int r0, c0, tr, tc;
+  for (int i = 0; i < job.count(); i++) {
+    job.bounds(i, r0, c0, tr, tc);
+    if (!mandel.loadEscapes(queue.gridPath(i).c_str(), r0, c0)) {
+      fprintf(stderr, "Could not load from %s\n", queue.gridPath(i).c_str());
+      ok = false;
+    }
+  }
+
+  queue.markDone();
+  for (pid_t pid : workers) waitpid(pid, NULL, 0);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  const char *png_fn = NULL, *escape_fn = NULL, *stats_fn = NULL, *trace_fn = NULL, *palette_fn = "default.pal";
+  const char *coordinate_dir = NULL, *work_dir = NULL, *checkpoint_dir = NULL, *cache_dir = NULL;
+  int w = 1920, h = 1080, sc = 1, N = 0, auto_max = 0, order = 3;
+  int nworkers = 0, tile = 256;
+  double timeout = 60.0;
+  int nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+  bool smooth = true;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:e:J:P:w:h:s:t:n:A:k:p:Sr:c:C:j:T:R:W:")) != -1)
+    switch (opt) {
+    case 'o': png_fn = optarg; break;
+    case 'e': escape_fn = optarg; break;
+    case 'J': stats_fn = optarg; break;
+    case 'P': trace_fn = optarg; break;
+    case 'w': w = atoi(optarg); break;
+    case 'h': h = atoi(optarg); break;
+    case 's': sc = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'n': N = atoi(optarg); break;
+    case 'A': auto_max = atoi(optarg); break;
+    case 'k': order = atoi(optarg); break;
+    case 'p': palette_fn = optarg; break;
+    case 'S': smooth = false; break;
+    case 'r': cache_dir = optarg; break;
+    case 'c': checkpoint_dir = optarg; break;
+    case 'C': coordinate_dir = optarg; break;
+    case 'j': nworkers = atoi(optarg); break;
+    case 'T': tile = atoi(optarg); break;
+    case 'R': timeout = atof(optarg); break;
+    case 'W': work_dir = optarg; break;
+    default: usage(); return 1;
+    }
+  if (trace_fn) Trace::start();
+  if (work_dir) {
+    int status = work(work_dir, std::max(1, nthreads));
+    if (trace_fn && !saveTrace(trace_fn)) status = 1;
+    return status;
+  }
+  std::unique_ptr<Checkpoint> checkpoint(checkpoint_dir? new Checkpoint(checkpoint_dir) : NULL);
+  bool resuming = checkpoint && checkpoint->exists();
+  if ((optind != argc - 1 && !(resuming && optind == argc)) || (checkpoint && coordinate_dir)
+      || w < 1 || h < 1 || sc < 1 || nthreads < 1 || N < 0 || auto_max < 0 || nworkers < 0 || tile < 1
+      || order < 2 || order > max_series_order) {
+    usage();
+    return 1;
+  }
+  if (!png_fn && !escape_fn) png_fn = "render.png";
+  
+  Mandelbrot mandel;
+  if (resuming) {
+    if (!checkpoint->resume(mandel)) {
+      fprintf(stderr, "Could not resume from %s\n", checkpoint_dir);
+      return 1;
+    }
+    sc = checkpoint->sc;
+    w = mandel.cols() / sc;
+    h = mandel.rows() / sc;
+    fprintf(stderr, "Resuming %s: %d of %d bands left\n", checkpoint_dir, checkpoint->remaining(), checkpoint->bands());
+  }
+  else {
+    //Locations are read at the viewer's size, then rescaled by height like a beauty render
+    const char* location_fn = argv[optind];
+    Mandelbrot location(600, 800);
+    if (!exists(location_fn)) {
+      fprintf(stderr, "Could not load from %s\n", location_fn);
+      return 1;
+    }
+    if (!location.load(location_fn)) location.loadLegacy(location_fn);
+
+    mandel = Mandelbrot(h * sc, w * sc);
+    HPComplex sz;
+    sz.re = location.sz.re * ((double)location.rows() / mandel.rows());
+    sz.im = location.sz.im * ((double)location.rows() / mandel.rows());
+    mandel.N = N? N : location.N;
+    mandel.power = location.power;
+    mandel.series_order = order;
+    if (cache_dir) mandel.reference_cache = cache_dir;
+    mandel.setView(location.center, sz);
+
+    if (auto_max) {
+      Clock::time_point t = Clock::now();
+      mandel.autoN(auto_max, nthreads);
+      fprintf(stderr, "Chose %d iterations in %.3fs\n", mandel.N, secondsSince(t));
+    }
+  }
+
+  fprintf(stderr, "Rendering %dx%d at %dx multisampling, %d iterations, %d threads (%s arithmetic)\n",
+	  w, h, sc, mandel.N, nthreads, Mandelbrot::arithmeticName(mandel.arithmetic()));
+  if (mandel.power != 2) fprintf(stderr, "Formula: z -> z^%d + c\n", mandel.power);
+
+  Clock::time_point start = Clock::now(), t = start;
+  if (!resuming) {
+    mandel.precompute();
+    fprintf(stderr, "Precompute: %.3fs\n", secondsSince(t));
+    if (checkpoint && !checkpoint->create(mandel, sc, checkpoint_band)) {
+      fprintf(stderr, "Could not create a checkpoint in %s\n", checkpoint_dir);
+      return 1;
+    }
+  }
+
+  t = Clock::now();
+  bool ok = true;
+  if (coordinate_dir)
+    ok = coordinate(coordinate_dir, mandel, tile, nworkers, nthreads, timeout, argv[0]);
+  else {
+    Clock::time_point shown = t;
+    auto progress = [&](int done) {
+      if (secondsSince(shown) > 0.25) {
+	fprintf(stderr, "\rRendered row %d / %d", done, mandel.rows());
+	shown = Clock::now();
+      }
+      return true;
+    };
+    if (checkpoint) ok = checkpoint->render(mandel, nthreads, progress);
+    else mandel.computeRows(nthreads, progress);
+    if (ok) fprintf(stderr, "\rRendered row %d / %d\n", mandel.rows(), mandel.rows());
+    else fprintf(stderr, "\nCould not save to %s\n", checkpoint_dir);
+  }
+  fprintf(stderr, "Render: %.3fs\n", secondsSince(t));
+  if (!ok) return 1;
+
+  if (escape_fn) {
+    if (mandel.saveEscapes(escape_fn)) fprintf(stderr, "Saved escape data to %s\n", escape_fn);
+    else {
+      fprintf(stderr, "Could not save to %s\n", escape_fn);
+      ok = false;
+    }
+  }
+  
+  if (png_fn) {
+    if (!exists(palette_fn)) {
+      fprintf(stderr, "Could not load from %s\n", palette_fn);
+      return 1;
+    }
+    
+    t = Clock::now();
+    MultiWaveGenerator mw;
+    mw.load_filename(palette_fn);
+    CachedPalette pal = mw.cache(mandel.N);
+    ByteImage img(h, w, 3);
+    {
+      TraceSpan span("recolor");
+      for (int r = 0; r < img.nr; r++)
+	colorLine(pal, smooth, mandel, sc, img, r);
+    }
+    mandel.stats.recolor_time = secondsSince(t);
+    fprintf(stderr, "Recolor: %.3fs\n", mandel.stats.recolor_time);
+    
+    {
+      TraceSpan span("savePNG");
+      img.save_filename(png_fn);
+    }
+    fprintf(stderr, "Saved render to %s\n", png_fn);
+  }
+
+  if (stats_fn) {
+    if (mandel.stats.save(stats_fn)) fprintf(stderr, "Saved statistics to %s\n", stats_fn);
+    else {
+      fprintf(stderr, "Could not save to %s\n", stats_fn);
+      ok = false;
+    }
+  }
+  
+  if (trace_fn && !saveTrace(trace_fn)) ok = false;
+  
+  if (ok && checkpoint) checkpoint->remove();
+  fprintf(stderr, "Total: %.3fs\n", secondsSince(start));
+  return ok? 0 : 1;
+}
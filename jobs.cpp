@@ -0,0 +1,123 @@
+#include "jobs.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+
+Job::Job(const std::string& name, int priority, const Work& work)
+  : work(work), status(QUEUED), cancel_flag(false), done(0), total(0), name(name), priority(priority), threads(1) { }
+
+void Job::setMessage(const std::string& message) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->message = message;
+}
+
+void Job::cancel() {
+  cancel_flag = true;
+  int queued = QUEUED;
+  status.compare_exchange_strong(queued, CANCELLED); //A running job stops at its next check
+}
+
+double Job::progress() const {
+  long long t = total;
+  return t? std::min(1.0, (double)done / t) : 0.0;
+}
+
+double Job::eta() const {
+  double p = progress();
+  if (getStatus() != RUNNING || p <= 0.0) return -1.0;
+  return secondsSince(start) * (1.0 - p) / p;
+}
+
+std::string Job::getMessage() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return message;
+}
+
+std::string Job::describe() const {
+  char buf[256];
+  double t;
+  switch (getStatus()) {
+  case QUEUED: snprintf(buf, sizeof(buf), "%s: queued", name.c_str()); break;
+  case RUNNING:
+    if ((t = eta()) < 0.0) snprintf(buf, sizeof(buf), "%s: %.0f%%", name.c_str(), 100.0 * progress());
+    else snprintf(buf, sizeof(buf), "%s: %.0f%%, %d:%02d left", name.c_str(), 100.0 * progress(),
+		  (int)t / 60, (int)t % 60);
+    break;
+  case DONE: snprintf(buf, sizeof(buf), "%s: done", name.c_str()); break;
+  case CANCELLED: snprintf(buf, sizeof(buf), "%s: cancelled", name.c_str()); break;
+  default: snprintf(buf, sizeof(buf), "%s: failed", name.c_str()); break;
+  }
+  return buf;
+}
+
+JobQueue::JobQueue(int nthreads) : stopping(false), nthreads(std::max(nthreads, 1)) {
+  runner = std::thread(&JobQueue::run, this);
+}
+
+JobQueue::~JobQueue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    for (auto& job : jobs) job->cancel();
+  }
+  wake.notify_all();
+  runner.join();
+}
+
+std::shared_ptr<Job> JobQueue::submit(const std::string& name, int priority, const Job::Work& work) {
+  std::shared_ptr<Job> job = std::make_shared<Job>(name, priority, work);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+  }
+  wake.notify_all();
+  return job;
+}
+
+std::vector<std::shared_ptr<Job>> JobQueue::list() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return jobs;
+}
+
+void JobQueue::clearFinished() {
+  std::lock_guard<std::mutex> lock(mutex);
+  jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const std::shared_ptr<Job>& job) {return job->finished();}),
+	     jobs.end());
+}
+
+void JobQueue::cancelAll() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& job : jobs) job->cancel();
+}
+
+int JobQueue::pending() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::count_if(jobs.begin(), jobs.end(), [](const std::shared_ptr<Job>& job) {return !job->finished();});
+}
+
+void JobQueue::run() {
+  for (;;) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+	if (stopping) return;
+	for (auto& j : jobs)
+	  if (j->getStatus() == Job::QUEUED && (!job || j->priority > job->priority)) job = j;
+	if (job) break;
+	wake.wait(lock);
+      }
+
+      //Claimed under the lock, so a cancel either comes first or finds it running. What eta
+      //and the work read is set first, since the UI reads it as soon as it sees RUNNING.
+      job->threads = nthreads;
+      job->start = Clock::now();
+      int queued = Job::QUEUED;
+      if (!job->status.compare_exchange_strong(queued, Job::RUNNING)) continue;
+    }
+
+    TraceSpan span("job");
+    bool ok = job->work(*job);
+    job->status = job->cancelled()? Job::CANCELLED : ok? Job::DONE : Job::FAILED;
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef _BPJ_NEWMAN_JOBS_H
+#define _BPJ_NEWMAN_JOBS_H
+
+#include "stats.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * A long render that runs behind the viewer. The work function reports its progress and
+ * checks for cancellation between rows or frames; anything else reads both from any thread.
+ */
+
+class Job {
+public:
+  enum Status {QUEUED, RUNNING, DONE, CANCELLED, FAILED};
+  typedef std::function<bool(Job& job)> Work; //Returns false on failure
+
+protected:
+  Work work;
+  std::atomic<int> status;
+  std::atomic<bool> cancel_flag;
+  std::atomic<long long> done, total;
+  Clock::time_point start;
+  mutable std::mutex mutex; //For message
+  std::string message;
+
+  friend class JobQueue;
+
+public:
+  const std::string name;
+  const int priority; //Higher runs first; submission order breaks ties
+  int threads;        //For the work function to use; set by the queue when it runs
+
+  Job(const std::string& name, int priority, const Work& work);
+
+  //For the work function
+  inline bool cancelled() const {return cancel_flag;}
+  inline void setProgress(long long done, long long total) {this->done = done; this->total = total;}
+  void setMessage(const std::string& message); //Shown when the job ends
+
+  void cancel();
+  inline Status getStatus() const {return (Status)status.load();}
+  inline bool finished() const {return getStatus() > RUNNING;}
+  double progress() const; //From 0 to 1
+  double eta() const;      //Seconds left, estimated from the progress so far; negative until there is some
+  std::string getMessage() const;
+  std::string describe() const; //One line for display
+};
+
+/*
+ * Runs jobs one at a time, highest priority first, each with the queue's threads to itself.
+ * The viewer gives it all but the cores it keeps for exploring, so long renders never take
+ * those.
+ */
+
+class JobQueue {
+protected:
+  std::vector<std::shared_ptr<Job>> jobs; //In submission order, until cleared
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  int nthreads;
+  std::thread runner;
+
+  void run();
+
+public:
+  JobQueue(int nthreads);
+  ~JobQueue(); //Cancels every job left and waits for the running one
+
+  std::shared_ptr<Job> submit(const std::string& name, int priority, const Job::Work& work);
+  std::vector<std::shared_ptr<Job>> list(); //Every job not yet cleared
+  void clearFinished();
+  void cancelAll();
+  int pending(); //Queued or running
+};
+
+#endif
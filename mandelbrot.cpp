@@ -1,14 +1,29 @@
 #include "mandelbrot.h"
+#include "trace.h"
+#include "doubledouble.h"
+#include "refcache.h"
+#include "perturb.h"
 #include <byteimage/types.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
 
 using namespace byteimage;
 
 Mandelbrot::Mandelbrot() : Mandelbrot(1, 1) { }
 
-Mandelbrot::Mandelbrot(int nr, int nc) : grid(nr, nc) {
+Mandelbrot::Mandelbrot(int nr, int nc) : grid(nr, nc), fixed_reference(false), forced_arithmetic(AUTO) {
   error_tolerance = 1e-10;
+  series_order = 3;
+  series_scale = 1.0;
+  lanes = vectorLanes();
+  bilinear = true;
   
   N = 256;
+  power = 2;
 
   center.re = -0.5; center.im = 0.0;
   sz.re = 4.0 / nc; sz.im = 3.0 / nr;
@@ -19,10 +34,10 @@ Mandelbrot::Mandelbrot(int nr, int nc) : grid(nr, nc) {
 void Mandelbrot::loadLegacy(const char* fn) {
   FILE* fp = fopen(fn, "r");
   if (fp) {
-    char buf[1024];
+    char re[1024] = "0", im[1024] = "0", buf[1024] = "0";
     fscanf(fp, "%d\n", &N);
-    fscanf(fp, "%s\n", buf); center.re = buf;
-    fscanf(fp, "%s\n", buf); center.im = buf;
+    fscanf(fp, "%s\n", re);
+    fscanf(fp, "%s\n", im);
     fscanf(fp, "%s\n", buf); sz.re = buf;
     fscanf(fp, "%s\n", buf); sz.im = buf;
     fclose(fp);
@@ -30,11 +45,13 @@ void Mandelbrot::loadLegacy(const char* fn) {
     sz.re = sz.re * (800.0 / cols());
     sz.im = sz.im * (600.0 / rows());
 
-    setPrecision();
+    setPrecision(); //Before the center, so it keeps all its digits
+    center.re = re;
+    center.im = im;
   }
 }
 
-void Mandelbrot::setPrecision() {
+int Mandelbrot::requiredPrecision() const {
   const double log_alpha = log2(1.0e-20);
   const int beta = 64;
 
@@ -43,23 +60,103 @@ void Mandelbrot::setPrecision() {
   
   int bits = (int)(beta - e + log_alpha);
   if (bits < 64) bits = 64;
+  return bits;
+}
+
+//The reference orbit is kept; precompute decides whether it still serves the new view
+void Mandelbrot::setPrecision() {
+  int bits = requiredPrecision();
 
-  mpf_set_default_prec(bits);//TODO: Determine if this is a necessary line
   center.re.set_prec(bits);
   center.im.set_prec(bits);
   sz.re.set_prec(bits);
   sz.im.set_prec(bits);
-  X.clear();
-  A.clear();
-  B.clear();
-  C.clear();
+  fixed_reference = false;
+}
+
+void Mandelbrot::setView(const HPComplex& center, const HPComplex& sz) {
+  this->sz.re.set_prec(sz.re.get_prec()); //Exactly, so a view seen before compares equal
+  this->sz.im.set_prec(sz.im.get_prec());
+  this->sz.re = sz.re;
+  this->sz.im = sz.im;
+  setPrecision();
+  this->center.re = center.re;
+  this->center.im = center.im;
+}
+
+void Mandelbrot::setReference(const Mandelbrot& source) {
+  reference = source.reference;
+  series = source.series;
+  prepareApproximations(); //At this view's scale
+  fixed_reference = true;
+}
+
+/*
+ * After a zoom or pan, the last reference still works if it is for the same formula, was
+ * computed with at least the precision this view needs, lies within the view (so the deltas
+ * stay as small as a fresh probe's would) and ran all N iterations without escaping, so no
+ * pixel can outlast it. The series depends only on the orbit, so it is kept as well.
+ */
+bool Mandelbrot::canServe(int power, int length, mp_bitcnt_t prec, const HPComplex& X0) const {
+  if (power != this->power || length < N || prec < requiredPrecision()) return false;
+
+  mpf_class dc = (X0.re - center.re) / sz.re, dr = (center.im - X0.im) / sz.im;
+  return fabs(dc.get_d()) <= 0.5 * cols() && fabs(dr.get_d()) <= 0.5 * rows();
 }
 
-constexpr double bailout = 1024.0;
-constexpr double bailout2 = bailout * bailout;
+bool Mandelbrot::canShare(const Mandelbrot& source) const {
+  const std::shared_ptr<const Reference>& orbit = source.reference;
+  return orbit && canServe(orbit->power, orbit->X.size(), orbit->X[0].re.get_prec(), orbit->X[0]);
+}
+
+//Unlike setReference, precompute still checks the orbit, and finds another once it stops serving
+bool Mandelbrot::offerReference(const Mandelbrot& source) {
+  if (useHardware() || reuseReference() || !canShare(source)) return false;
+  reference = source.reference;
+  series = source.series;
+  return true;
+}
+
+bool Mandelbrot::reuseReference() {
+  return reference && canServe(reference->power, reference->X.size(), reference->X[0].re.get_prec(), reference->X[0]);
+}
+
+//What findProbe found for this very view, or else the same test as for the last reference
+bool Mandelbrot::loadCachedReference() {
+  if (reference_cache.empty()) return false;
+
+  TraceSpan span("loadCachedReference");
+  ReferenceCache cache(reference_cache);
+  ReferenceCache::Entry entry;
+  std::vector<HPComplex> X;
+  std::shared_ptr<Series> cached = std::make_shared<Series>();
+  unsigned long long view = ReferenceCache::viewKey(center, sz, rows(), cols(), N, power);
+  if (!cache.find([&](const ReferenceCache::Entry& e) {
+	return (e.view == view && e.power == power) || canServe(e.power, e.length, e.prec, e.X0);
+      }, entry)
+      || !cache.load(entry, X, cached->S))
+    return false;
+
+  reference = std::make_shared<Reference>(std::move(X), power);
+  cached->order = entry.order;
+  if (entry.order) series = cached;
+  else series.reset();
+  return true;
+}
 
 inline static bool bailedOut(HPComplex& z) {return sqMag(descend(z)) > bailout2;}
 
+//In double precision: 1 inside the cardioid or period-2 disk, -1 outside both, 0 too close to tell
+static int cardioidSide(const LPComplex& z) {
+  const double margin = 1e-12; //Far above the rounding of a coordinate near the set
+  double xmf = z.re - 0.25, y2 = z.im * z.im, q = xmf * xmf + y2;
+  double cardioid = q * (q + xmf) - 0.25 * y2;
+  double disk = (z.re + 1.0) * (z.re + 1.0) + y2 - 0.0625;
+  if (cardioid < -margin || disk < -margin) return 1;
+  if (cardioid > margin && disk > margin) return -1;
+  return 0;
+}
+
 bool Mandelbrot::inCardioid(const HPComplex& Z) {
   mpf_class fourth = 0.25;
   mpf_class xmf = Z.re - fourth;
@@ -70,9 +167,11 @@ bool Mandelbrot::inCardioid(const HPComplex& Z) {
   return (q * q + y2 < fourth * fourth);//Second disk
 }
 
-void Mandelbrot::findProbe() {
+std::vector<HPComplex> Mandelbrot::findProbe(const Kernel& kernel, const std::function<bool()>& keep_going) {
+  TraceSpan span("findProbe");
   std::vector<Pt> probe_pts;
-  HPComplex probe;
+  std::vector<HPComplex> X, longest;
+  HPComplex probe(precision());
 
   for (int c = 0; c < cols(); c += 2) {
     probe_pts.push_back(Pt(rows() / 4, c));
@@ -85,205 +184,555 @@ void Mandelbrot::findProbe() {
   for (auto pt : probe_pts) {
     probe.re = center.re + (pt.c - cols() / 2) * sz.re;
     probe.im = center.im + (rows() / 2 - pt.r - 1) * sz.im;
-    computeOrbit(probe);
+    Clock::time_point t = Clock::now();
+    if (!(this->*kernel.orbit)(probe, X, keep_going)) return std::vector<HPComplex>();
+    stats.orbit_time += secondsSince(t);
+    stats.probes++;
     
-    if (X.size() > A.size())
-      std::swap(X, A);
+    if (X.size() > longest.size())
+      std::swap(X, longest);
   }
 
-  std::swap(X, A);
+  return longest;
 }
 
-void Mandelbrot::computeOrbit(const HPComplex& X0) {
-  X.clear(); X.resize(N);
+template <class F>
+bool Mandelbrot::computeOrbit(const HPComplex& X0, std::vector<HPComplex>& X, const std::function<bool()>& keep_going) const {
+  TraceSpan span("computeOrbit");
+  X.assign(N, HPComplex(X0.re.get_prec()));
   X[0].re = X0.re; X[0].im = X0.im;
 
   for (int i = 1; i < X.size(); i++) {
-    X[i].re = X[i - 1].re * X[i - 1].re - X[i - 1].im * X[i - 1].im + X0.re;
-    X[i].im = 2.0 * (X[i - 1].re * X[i - 1].im) + X0.im;
+    F::step(X[i - 1], X0, X[i]);
     
     if (bailedOut(X[i])) {
       X.resize(i);
-      return;
+      return true;
     }
+    if (keep_going && !(i & 1023) && !keep_going()) return false;
   }
+  return true;
 }
 
+//From the descended orbit: each coefficient needs a double's mantissa but a far wider exponent.
+//Term k + 1 gets twice X times itself, plus the product of every pair of lower terms adding to it
 void Mandelbrot::computeSeries() {
-  A.resize(X.size());
-  B.resize(X.size());
-  C.resize(X.size());
-  
-  A[0].re = 1.0;  A[0].im = 0.0;
-  B[0].re = 0.0;  B[0].im = 0.0;
-  C[0].re = 0.0;  C[0].im = 0.0;
-
-  for (int i = 1; i < X.size(); i++) {
-    A[i].re = 2.0 * (X[i - 1].re * A[i - 1].re - X[i - 1].im * A[i - 1].im) + 1.0;
-    A[i].im = 2.0 * (X[i - 1].re * A[i - 1].im + X[i - 1].im * A[i - 1].re);
-
-    B[i].re = 2.0 * (X[i - 1].re * B[i - 1].re - X[i - 1].im * B[i - 1].im) + A[i].re * A[i].re - A[i].im * A[i].im;
-    B[i].im = 2.0 * (X[i - 1].re * B[i - 1].im + X[i - 1].im * B[i - 1].re + A[i].re * A[i].im);
-
-    C[i].re = 2.0 * (X[i - 1].re * C[i - 1].re - X[i - 1].im * C[i - 1].im + A[i].re * B[i].re - A[i].im * B[i].im);
-    C[i].im = 2.0 * (X[i - 1].re * C[i - 1].im + X[i - 1].im * C[i - 1].re + A[i].re * B[i].im + A[i].im * B[i].re);
+  TraceSpan span("computeSeries");
+  const std::vector<LPComplex>& Xd = reference->Xd;
+  const int K = series_order;
+  std::shared_ptr<Series> series = std::make_shared<Series>();
+  this->series = series;
+  series->order = K;
+  std::vector<FEComplex>& S = series->S;
+  S.assign(Xd.size() * K, FEComplex());
+  if (S.empty()) return;
+  S[0] = FEComplex(LPComplex(1.0, 0.0));
+
+  FEComplex one(LPComplex(1.0, 0.0)), twiceX, sum;
+  for (int i = 1; i < Xd.size(); i++) {
+    const FEComplex* s = &S[(i - 1) * K];
+    FEComplex* t = &S[i * K];
+    twiceX = FEComplex(LPComplex(2.0 * Xd[i - 1].re, 2.0 * Xd[i - 1].im));
+
+    t[0] = twiceX * s[0] + one;
+    for (int k = 1; k < K; k++) {
+      int j = 0, l = k - 1;
+      sum = FEComplex();
+      for (; j < l; j++, l--) sum = sum + s[j] * s[l];
+      sum = sum + sum;
+      if (j == l) sum = sum + s[j] * s[j];
+      t[k] = twiceX * s[k] + sum;
+    }
   }
 }
 
-static double getSmoothingMagnitude(const LPComplex& z) {
-  double r2 = sqMag(z);
-  return 1.0 - log2(0.5 * log(r2) / log(bailout));
-}
+void Mandelbrot::prepareApproximations() {
+  if (bilinear) {
+    //Bounds every pixel's delta0: the view's center from X[0], then its corners from the center
+    const HPComplex& X0 = reference->X[0];
+    mpf_class dx = center.re - X0.re, dy = center.im - X0.im;
+    double max_delta0 = hypot(dx.get_d(), dy.get_d()) + 0.5 * hypot(cols() * sz.re.get_d(), rows() * sz.im.get_d());
+    //Tighter than the series' ratio of squares, since each step's error carries through the rest of the orbit
+    bla.build(reference->Xd.data(), referenceLength(), reference->power, max_delta0, 100.0 * error_tolerance);
+  }
+  else bla.clear();
 
-bool Mandelbrot::isUnstable(const LPComplex& bterm, const LPComplex& cterm) {
-  double bmag = bterm.re * bterm.re + bterm.im * bterm.im;
-  double cmag = cterm.re * cterm.re + cterm.im * cterm.im;
-  return (bmag * error_tolerance < cmag);
-}
+  if (!kernel().series) {
+    series.reset();
+    Sd.clear();
+    return;
+  }
+  if (!series || series->order != series_order) computeSeries();
+  const std::vector<FEComplex>& S = series->S;
 
-RenderGrid::EscapeValue Mandelbrot::getIterations(const HPComplex& Y0) {
-  RenderGrid::EscapeValue escape;
-  LPComplex eps, eps2, eps3, a, b, c;
-  HPComplex Y;
+  //Powers of two, so scaling the pixels' deltas is exact
+  signed long int e;
+  mpf_get_d_2exp(&e, sz.re.get_mpf_t());
+  series_scale = ldexp(1.0, std::max((int)e, -1022));
 
-  if (inCardioid(Y0)) {
-    escape.iterations = N;
-    escape.smoothing = 0.0;
-    return escape;
+  FloatExp scale(series_scale), factor[max_series_order];
+  factor[0] = scale;
+  for (int k = 1; k < series_order; k++) factor[k] = factor[k - 1] * scale;
+
+  Sd.resize(S.size());
+  for (int i = 0; i < S.size(); i++) {
+    const FloatExp& f = factor[i % series_order];
+    Sd[i] = descend(FEComplex(S[i].re * f, S[i].im * f));
   }
-  
-  Y.re = Y0.re - X[0].re;
-  Y.im = Y0.im - X[0].im;
-  
-  eps.re = Y.re.get_d();
-  eps.im = Y.im.get_d();
-  eps2 = sq(eps);
-  eps3 = eps * eps2;
+}
 
-  std::vector<LPComplex> d(X.size());
-  d[0] = eps;
-  for (int i = 1; i < X.size(); i++) {
-    a.re = A[i].re.get_d(); a.im = A[i].im.get_d();
-    b.re = B[i].re.get_d(); b.im = B[i].im.get_d();
-    c.re = C[i].re.get_d(); c.im = C[i].im.get_d();
-
-    a = a * eps;
-    b = b * eps2;
-    c = c * eps3;
-    if (isUnstable(b, c)) {
-      int good = i - 3;
-      if (good < 1) good = 1;
-      d.resize(good);
-      break;
+//The series up to where each pixel can trust it, then deltas from the reference in double
+//precision, a row's pixels (or a single point) at a time.
+template <class F>
+void Mandelbrot::perturbPoints(const LPComplex* delta0, const std::function<HPComplex(int)>& point,
+			       RenderGrid::EscapeValue* escapes, int count, RenderStats& stats) {
+  const std::vector<LPComplex>& Xd = reference->Xd;
+  std::vector<PerturbItem> items;
+  items.reserve(count);
+  
+  for (int i = 0; i < count; i++) {
+    int side = F::cardioid? cardioidSide(Xd[0] + delta0[i]) : -1;
+    if (side > 0 || (!side && inCardioid(point(i)))) {
+      escapes[i].iterations = N;
+      escapes[i].smoothing = 0.0;
+      stats.cardioid_pixels++;
+      stats.maxed_pixels++;
+      stats.iterations += N;
+      continue;
     }
-    
-    d[i] = a + b + c;
+    stats.perturbation_pixels++;
+    items.push_back(PerturbItem(i, 0, delta0[i], delta0[i]));
   }
 
-  int found = d.size() - 1;
-  Y.re = X[found].re + d[found].re;
-  Y.im = X[found].im + d[found].im;
-  if (bailedOut(Y)) {  
-    int low = 0, high = d.size() - 1, mid = d.size() / 2;
-    while (low <= high) {
-      Y.re = X[mid].re + d[mid].re;
-      Y.im = X[mid].im + d[mid].im;
-
-      if (!bailedOut(Y))
-	low = mid + 1;
-      else {
-	high = mid - 1;
-	found = mid;
-      }
+  if (F::series)
+    approximate(Sd.data(), series_order, referenceLength(), series_scale, error_tolerance, items.data(), items.size(), lanes);
+
+  int running = 0;
+  for (auto& item : items) {
+    int found = item.n;
+    if (F::series && sqMag(Xd[found] + item.delta) > bailout2) {
+      //Escaped within the series
+      auto delta = [&](int i) {return seriesDelta(Sd.data(), series_order, i, series_scale, item.delta0);};
+      int low = 0, high = found, mid = (found + 1) / 2;
+      while (low <= high) {
+	if (sqMag(Xd[mid] + delta(mid)) <= bailout2)
+	  low = mid + 1;
+	else {
+	  high = mid - 1;
+	  found = mid;
+	}
     
-      mid = (low + high) / 2;
+	mid = (low + high) / 2;
+      }
+
+      escapes[item.index].iterations = found;
+      escapes[item.index].smoothing = F::smoothing(Xd[found] + delta(found));
+      stats.iterations += found;
+      stats.addSkipped(found);
+      stats.searches++;
+      continue;
     }
 
-    Y.re = X[found].re + d[found].re;
-    Y.im = X[found].im + d[found].im;
-    escape.iterations = found;
-    escape.smoothing = getSmoothingMagnitude(descend(Y));
+    stats.addSkipped(found);
+    stats.perturbed_iterations -= found; //finishPerturbation adds back where the delta stopped
+    items[running++] = item;
+  }
+
+  perturbKernel(F::power, lanes, bilinear)(Xd.data(), referenceLength(), N, bilinear? &bla : NULL, items.data(), running);
+
+  for (int i = 0; i < running; i++)
+    escapes[items[i].index] = finishPerturbation<F>(point, items[i], stats);
+}
+
+template <class F>
+RenderGrid::EscapeValue Mandelbrot::finishPerturbation(const std::function<HPComplex(int)>& point, const PerturbItem& item,
+							RenderStats& stats) {
+  RenderGrid::EscapeValue escape;
+  stats.perturbed_iterations += item.n;
+  stats.perturb_steps += item.steps;
+  stats.rebases += item.rebases;
+
+  switch (item.status) {
+  case PerturbItem::ESCAPED:
+    escape.iterations = item.n;
+    escape.smoothing = F::smoothing(reference->Xd[item.m] + item.delta);
+    stats.iterations += item.n;
     return escape;
+    
+  case PerturbItem::MAXED:
+    escape.iterations = N;
+    escape.smoothing = 0.0;
+    stats.maxed_pixels++;
+    stats.iterations += N;
+    return escape;
+
+  default:
+    const HPComplex& X = reference->X[item.m];
+    HPComplex Y(precision());
+    Y.re = X.re + item.delta.re;
+    Y.im = X.im + item.delta.im;
+    stats.detached++;
+    return iterateHP<F>(point(item.index), Y, item.n, stats);
   }
-  
-  HPComplex Yn;
-  Yn.re = Y.re;
-  Yn.im = Y.im;
-  for (int i = d.size(); i < N; i++) {
-    Yn.re = Y.re * Y.re - Y.im * Y.im + Y0.re;
-    Yn.im = 2.0 * (Y.re * Y.im) + Y0.im;
+}
+
+//Continues from Y, the value at iteration n
+template <class F>
+RenderGrid::EscapeValue Mandelbrot::iterateHP(const HPComplex& Y0, HPComplex Y, int n, RenderStats& stats) {
+  RenderGrid::EscapeValue escape;
+  HPComplex Yn(Y.re.get_prec());
+  for (int i = n + 1; i < N; i++) {
+    F::step(Y, Y0, Yn);
 
     if (bailedOut(Yn)) {
       escape.iterations = i;
-      escape.smoothing = getSmoothingMagnitude(descend(Yn));
+      escape.smoothing = F::smoothing(descend(Yn));
+      stats.iterations += i;
+      stats.tail_iterations += i - n;
       return escape;
     }
 
-    Y.re = Yn.re;
-    Y.im = Yn.im;      
+    std::swap(Y.re, Yn.re);
+    std::swap(Y.im, Yn.im);
   }
 
   escape.iterations = N;
   escape.smoothing = 0.0;
+  stats.maxed_pixels++;
+  stats.iterations += N;
+  stats.tail_iterations += std::max(N - 1 - n, 0);
   return escape;
 }
 
-RenderGrid::EscapeValue Mandelbrot::getIterationsHW(const HPComplex& Y0) {
+template <class F>
+RenderGrid::EscapeValue Mandelbrot::getIterations(const HPComplex& Y0, RenderStats& stats) {
   RenderGrid::EscapeValue escape;
-  HPComplex pt;
-  LPComplex Z, Z0 = descend(Y0);
+  const HPComplex& X0 = reference->X[0];
+  HPComplex Y(precision());
+  Y.re = Y0.re - X0.re;
+  Y.im = Y0.im - X0.im;
+  LPComplex delta0 = descend(Y);
+  perturbPoints<F>(&delta0, [&](int) {return Y0;}, &escape, 1, stats);
+  return escape;
+}
 
-  if (inCardioid(Y0)) {
-    escape.iterations = N;
-    escape.smoothing = 0.0;
-    return escape;
-  }
+//Only the row's offset from the reference is found in high precision; each pixel's is a
+//double away from it, and its exact coordinate is rebuilt only if it has to finish in HP
+template <class F>
+void Mandelbrot::computeRowPerturbation(int r, int c0, int c1, RenderStats& stats) {
+  const HPComplex& X0 = reference->X[0];
+  HPComplex Y(precision());
+  Y.re = center.re - X0.re;
+  Y.im = center.im + (rows() / 2 - r - 1) * sz.im - X0.im;
+  LPComplex offset = descend(Y);
+  double step = sz.re.get_d();
+
+  std::vector<LPComplex> delta0(c1 - c0);
+  for (int c = c0; c < c1; c++)
+    delta0[c - c0] = LPComplex(offset.re + (c - cols() / 2) * step, offset.im);
+  perturbPoints<F>(delta0.data(), [&](int i) {return pointAt(r, c0 + i);}, &grid.at(r, c0), c1 - c0, stats);
+}
+
+//Scalar types for the hardware tiers
+template <typename Real> inline static Real fromMPF(const mpf_class& x) {return x.get_d();}
+template <> inline long double fromMPF<long double>(const mpf_class& x) {
+  double hi = x.get_d();
+  mpf_class rest = x - hi;
+  return (long double)hi + rest.get_d();
+}
+template <> inline DoubleDouble fromMPF<DoubleDouble>(const mpf_class& x) {return DoubleDouble(x);}
+
+inline static double toDouble(double x) {return x;}
+inline static double toDouble(long double x) {return (double)x;}
+inline static double toDouble(const DoubleDouble& x) {return x.toDouble();}
+
+template <class F, typename Real>
+static RenderGrid::EscapeValue escapeTime(const HPComplex& Y0, int N) {
+  RenderGrid::EscapeValue escape;
+  Real x0 = fromMPF<Real>(Y0.re), y0 = fromMPF<Real>(Y0.im), x = x0, y = y0;
+  double re, im;
   
-  Z = Z0;
   for (escape.iterations = 0; escape.iterations < N; escape.iterations++) {
-    Z = sq(Z) + Z0;
-    if (sqMag(Z) > bailout2) break;
+    F::step(x, y, x0, y0);
+    re = toDouble(x);
+    im = toDouble(y);
+    if (re * re + im * im > bailout2) break;
   }
-  
+
   if (escape.iterations < N)
-    escape.smoothing = getSmoothingMagnitude(Z);
+    escape.smoothing = F::smoothing(LPComplex(re, im));
   else
     escape.smoothing = 0.0;
+  return escape;
+}
+
+template <class F, typename Real>
+RenderGrid::EscapeValue Mandelbrot::getIterationsHW(const HPComplex& Y0, RenderStats& stats) {
+  RenderGrid::EscapeValue escape;
+
+  int side = F::cardioid? cardioidSide(descend(Y0)) : -1;
+  if (side > 0 || (!side && inCardioid(Y0))) {
+    escape.iterations = N;
+    escape.smoothing = 0.0;
+    stats.cardioid_pixels++;
+    stats.maxed_pixels++;
+    stats.iterations += N;
+    return escape;
+  }
+  stats.hardware_pixels++;
+
+  escape = escapeTime<F, Real>(Y0, N);
+  if (escape.iterations == N) stats.maxed_pixels++;
+  stats.iterations += escape.iterations;
+  stats.tail_iterations += escape.iterations;
 
   return escape;
 }
 
-bool Mandelbrot::useHardware() {
-  const double minpreview = 1.5e-16;
-  return (sz.re.get_d() >= minpreview && sz.im.get_d() >= minpreview);
+template <class F, typename Real>
+void Mandelbrot::computeRowHW(int r, int c0, int c1, RenderStats& stats) {
+  HPComplex pt(precision());
+  pt.im = center.im + (rows() / 2 - r - 1) * sz.im;
+  for (int c = c0; c < c1; c++) {
+    pt.re = center.re + (c - cols() / 2) * sz.re;
+    grid.at(r, c) = getIterationsHW<F, Real>(pt, stats);
+  }
 }
 
-void Mandelbrot::precompute() {
-  if (useHardware()) return;
-  //setPrecision();
-  X.clear(); A.clear(); B.clear(); C.clear();
-  findProbe();
-  computeSeries();
+template <class F>
+Mandelbrot::Kernel Mandelbrot::kernelFor() const {
+  Kernel kernel;
+  kernel.orbit = &Mandelbrot::computeOrbit<F>;
+  kernel.series = F::series;
+  
+  switch (arithmetic()) {
+  case HARDWARE:
+    kernel.row = &Mandelbrot::computeRowHW<F, double>;
+    kernel.point = &Mandelbrot::getIterationsHW<F, double>;
+    break;
+  case LONG_DOUBLE:
+    kernel.row = &Mandelbrot::computeRowHW<F, long double>;
+    kernel.point = &Mandelbrot::getIterationsHW<F, long double>;
+    break;
+  case DOUBLE_DOUBLE:
+    kernel.row = &Mandelbrot::computeRowHW<F, DoubleDouble>;
+    kernel.point = &Mandelbrot::getIterationsHW<F, DoubleDouble>;
+    break;
+  default:
+    kernel.row = &Mandelbrot::computeRowPerturbation<F>;
+    kernel.point = &Mandelbrot::getIterations<F>;
+    break;
+  }
+  return kernel;
 }
 
-void Mandelbrot::computeRow(int r) {
-  HPComplex pt;
-  pt.im = center.im + (rows() / 2 - r - 1) * sz.im;
+Mandelbrot::Kernel Mandelbrot::kernel() const {
+  static_assert(max_power == 5, "Add the new powers here");
+  switch (power) {
+  case 3: return kernelFor<Multibrot<3>>();
+  case 4: return kernelFor<Multibrot<4>>();
+  case 5: return kernelFor<Multibrot<5>>();
+  default: return kernelFor<Multibrot<2>>();
+  }
+}
 
-  if (useHardware())
-    for (int c = 0; c < cols(); c++) {
-      pt.re = center.re + (c - cols() / 2) * sz.re;
-      grid.at(r, c) = getIterationsHW(pt);
-    }
-  else
-    for (int c = 0; c < cols(); c++) {
-      pt.re = center.re + (c - cols() / 2) * sz.re;
-      grid.at(r, c) = getIterations(pt);
+//Each tier needs a few bits beyond the pixel spacing; below the last one, perturbation takes over
+Mandelbrot::Arithmetic Mandelbrot::arithmetic() const {
+  if (forced_arithmetic != AUTO) return forced_arithmetic;
+
+  double pixel = std::min(sz.re.get_d(), sz.im.get_d());
+  if (pixel >= 1.5e-16) return HARDWARE;
+  if (pixel >= 1.0e-18 && std::numeric_limits<long double>::digits >= 64) return LONG_DOUBLE;
+  return PERTURBATION; //Faster than double-double now that the deltas are vectorized
+}
+
+const char* Mandelbrot::arithmeticName(Arithmetic arithmetic) {
+  switch (arithmetic) {
+  case HARDWARE: return "hardware";
+  case LONG_DOUBLE: return "long-double";
+  case DOUBLE_DOUBLE: return "double-double";
+  case PERTURBATION: return "perturbation";
+  default: return "auto";
+  }
+}
+
+bool Mandelbrot::useHardware() const {return arithmetic() != PERTURBATION;}
+
+bool Mandelbrot::precompute(const std::function<bool()>& keep_going) {
+  TraceSpan span("precompute");
+  stats.clear();
+  if (useHardware() || fixed_reference) return true;
+
+  Clock::time_point t = Clock::now();
+  bool found = false;
+  if (reuseReference()) stats.reused_references++;
+  else if (loadCachedReference()) {
+    stats.cached_references++;
+    stats.probe_time = secondsSince(t);
+  }
+  else {
+    reference.reset();
+    series.reset();
+    std::vector<HPComplex> X = findProbe(kernel(), keep_going);
+    if (X.empty()) return false;
+    reference = std::make_shared<Reference>(std::move(X), power);
+    stats.probe_time = secondsSince(t);
+    found = true;
+  }
+
+  t = Clock::now();
+  prepareApproximations(); //The series is kept across zooms, but rescaled for each
+  stats.series_time = secondsSince(t);
+
+  //With its series, so a later run skips both
+  if (found && !reference_cache.empty() && stats.probe_time >= ReferenceCache::min_seconds) {
+    TraceSpan span("storeReference");
+    static const std::vector<FEComplex> none;
+    ReferenceCache(reference_cache).store(reference->X, power, series? series->S : none, series? series->order : 0,
+					  ReferenceCache::viewKey(center, sz, rows(), cols(), N, power));
+  }
+  return true;
+}
+
+Mandelbrot::Reference::Reference(std::vector<HPComplex>&& X, int power) : X(std::move(X)), power(power) {
+  Xd.resize(this->X.size());
+  for (int i = 0; i < Xd.size(); i++) Xd[i] = descend(this->X[i]);
+}
+
+void Mandelbrot::computeRow(int r) {computeRow(r, kernel(), stats);}
+
+void Mandelbrot::computeRow(int r, RenderStats& stats) {computeRow(r, kernel(), stats);}
+
+void Mandelbrot::computeRow(int r, int c0, int c1) {computeRow(r, c0, c1, kernel(), stats);}
+
+void Mandelbrot::computeRow(int r, const Kernel& kernel, RenderStats& stats) {computeRow(r, 0, cols(), kernel, stats);}
+
+void Mandelbrot::computeRow(int r, int c0, int c1, const Kernel& kernel, RenderStats& stats) {
+  if (c0 >= c1) return;
+  TraceSpan span("computeRow", "row", r);
+  Clock::time_point t = Clock::now();
+  (this->*kernel.row)(r, c0, c1, stats);
+  stats.row_time += secondsSince(t);
+}
+
+//Row r lies at center.im + (rows() / 2 - r - 1) * sz.im, so r and r' are conjugate when
+//r + r' = 2 * (rows() / 2 - 1) + 2 * center.im / sz.im, if that is a whole number
+int Mandelbrot::mirrorSum() const {
+  mpf_class m(0, precision());
+  m = 2 * center.im / sz.im;
+  double x = m.get_d();
+  if (!(std::abs(x) < 2.0 * rows())) return -1;
+  int k = (int)std::lround(x);
+  if (std::abs(x - k) > 1.0e-6) return -1;
+  return 2 * (rows() / 2 - 1) + k;
+}
+
+bool Mandelbrot::copyMirror(int r, int sum, RenderStats& stats) {
+  int m = sum - r;
+  if (sum < 0 || m < 0 || m >= r) return false;
+  std::copy(&grid.at(m, 0), &grid.at(m, 0) + cols(), &grid.at(r, 0));
+  stats.mirrored_pixels += cols();
+  return true;
+}
+
+bool Mandelbrot::copyMirror(int r) {return copyMirror(r, mirrorSum(), stats);}
+
+RenderGrid::EscapeValue Mandelbrot::computePoint(const HPComplex& pt) {return (this->*kernel().point)(pt, stats);}
+
+bool Mandelbrot::computeRows(int nthreads, const std::function<bool(int)>& progress) {
+  return computeRows(0, rows(), nthreads, progress);
+}
+
+bool Mandelbrot::computeRows(int r0, int r1, int nthreads, const std::function<bool(int)>& progress) {
+  //Rows mirroring one above them are copied once the rest are done
+  int sum = mirrorSum();
+  std::vector<int> computed;
+  for (int r = r0; r < r1; r++)
+    if (sum < 0 || sum - r < 0 || sum - r >= r) computed.push_back(r);
+
+  std::atomic<int> next(0), done(0);
+  std::atomic<bool> cancel(false);
+  std::vector<RenderStats> thread_stats(std::max(nthreads, 1));
+  Kernel kernel = this->kernel();
+
+  auto work = [&](int i) {
+    for (int j; !cancel && (j = next++) < (int)computed.size();) {
+      computeRow(computed[j], kernel, thread_stats[i]);
+      done++;
+      if (!i && progress && !progress(done)) cancel = true;
     }
+  };
+  
+  std::vector<std::thread> threads;
+  for (int i = 1; i < nthreads; i++)
+    threads.emplace_back(work, i);
+  work(0);
+  for (auto& thread : threads) thread.join();
+  for (auto& s : thread_stats) stats.merge(s);
+  if (cancel) return false;
+
+  if (computed.size() < r1 - r0) {
+    for (int r = r0; r < r1; r++)
+      copyMirror(r, sum, stats);
+    if (progress) progress(r1 - r0);
+  }
+  return true;
+}
+
+/*
+ * Renders the view at an eighth of its size, first to 256 iterations, then doubling the limit
+ * until a doubling lets no more than a thousandth of the pixels escape. Until any pixel
+ * escapes, the limit keeps rising: deep views can need thousands of iterations everywhere. The
+ * longest probe orbit counts as one more pixel, since it escaping means the whole probe cross
+ * did. N is then the last escape seen with a quarter to spare, in the viewer's steps of 256.
+ */
+int Mandelbrot::autoN(int max_N, int nthreads) {
+  TraceSpan span("autoN");
+  const int step = 256, shrink = 8, max_idle = 4; //Doublings that find no escapes at all before giving up
+  Mandelbrot coarse(std::max(rows() / shrink, 1), std::max(cols() / shrink, 1));
+  HPComplex coarse_sz(precision());
+  coarse_sz.re = sz.re * ((double)rows() / coarse.rows());
+  coarse_sz.im = sz.im * ((double)rows() / coarse.rows());
+  coarse.setView(center, coarse_sz);
+  coarse.power = power;
+  coarse.forced_arithmetic = forced_arithmetic;
+  coarse.error_tolerance = error_tolerance;
+  coarse.series_order = series_order;
+  coarse.lanes = lanes;
+  coarse.bilinear = bilinear;
+  coarse.reference_cache = reference_cache;
+
+  //From half the last count, since the next view rarely needs much less; escapes below it still count
+  long long pixels = (long long)coarse.rows() * coarse.cols(), escaped = 0, now;
+  int limit = std::min(std::max(N / 2 / step * step, step), max_N), highest = 0, idle = 0;
+  for (;;) {
+    coarse.N = limit;
+    coarse.precompute();
+    coarse.computeRows(nthreads);
+
+    now = 0;
+    for (int r = 0; r < coarse.rows(); r++)
+      for (int c = 0; c < coarse.cols(); c++)
+	if (coarse.at(r, c).iterations < limit) {
+	  now++;
+	  highest = std::max(highest, coarse.at(r, c).iterations);
+	}
+    if (!coarse.useHardware() && coarse.referenceLength() < limit)
+      highest = std::max(highest, coarse.referenceLength());
+
+    //Inside the set, nothing escapes however far it goes
+    if (!now) idle++;
+    if (limit >= max_N || now == pixels || (now && now - escaped <= pixels / 1000) || idle >= max_idle) break;
+    escaped = now;
+    limit = std::min(2 * limit, max_N);
+  }
+
+  N = std::min(std::max((highest + highest / 4 + step - 1) / step * step, step), max_N);
+  return N;
 }
 
 HPComplex Mandelbrot::pointAt(int r, int c, int sc) const {
-  HPComplex pt;
+  HPComplex pt(precision());
   pt.re = center.re + (sc * c - cols() / 2) * sz.re;
   pt.im = center.im + (rows() / 2 - sc * r - 1) * sz.im;
   return pt;
@@ -301,23 +750,41 @@ void Mandelbrot::zoom(float scale) {
   setPrecision();
 }
 
-void Mandelbrot::zoomAt(float scale, int r, int c, int sc) {
-  HPComplex pt;
-  pt.re = center.re + (sc * c - cols() / 2) * sz.re;
-  pt.im = center.im + (rows() / 2 - sc * r - 1) * sz.im;
-  
-  sz.re *= (1.0 / scale);
-  sz.im *= (1.0 / scale);
+void Mandelbrot::zoomedView(float scale, int r, int c, int sc, HPComplex& center, HPComplex& sz) const {
+  HPComplex pt(precision());
+  pt.re = this->center.re + (sc * c - cols() / 2) * this->sz.re;
+  pt.im = this->center.im + (rows() / 2 - sc * r - 1) * this->sz.im;
+
+  for (mpf_class* v : {&center.re, &center.im, &sz.re, &sz.im}) v->set_prec(precision());
+  sz.re = this->sz.re * (1.0 / scale);
+  sz.im = this->sz.im * (1.0 / scale);
   
   center.re = pt.re - (sc * c - cols() / 2) * sz.re;
   center.im = pt.im - (rows() / 2 - sc * r - 1) * sz.im;
+}
+
+void Mandelbrot::zoomAt(float scale, int r, int c, int sc) {
+  HPComplex new_center, new_sz;
+  zoomedView(scale, r, c, sc, new_center, new_sz);
+  center.re = new_center.re;
+  center.im = new_center.im;
+  sz.re = new_sz.re;
+  sz.im = new_sz.im;
 
   setPrecision();
 }
 
-const RenderGrid::EscapeValue& Mandelbrot::at(int r, int c) {return grid.at(r, c);}
+const RenderGrid::EscapeValue& Mandelbrot::at(int r, int c) const {return grid.at(r, c);}
 
-RenderGrid::EscapeValue Mandelbrot::at(int r, int c, int sc) {
+void Mandelbrot::paste(const RenderGrid& source, int dr, int dc) {
+  int r0 = std::max(0, -dr), r1 = std::min(rows(), source.nr - dr);
+  int c0 = std::max(0, -dc), c1 = std::min(cols(), source.nc - dc);
+  for (int r = r0; r < r1; r++)
+    for (int c = c0; c < c1; c++)
+      grid.at(r, c) = source.at(r + dr, c + dc);
+}
+
+RenderGrid::EscapeValue Mandelbrot::at(int r, int c, int sc) const {
   RenderGrid::EscapeValue escape;
   float sum = 0.0;
   for (int r1 = 0; r1 < sc; r1++)
@@ -359,6 +826,136 @@ void Mandelbrot::scaleDown(int sc) {
   setPrecision();
 }
 
-void Mandelbrot::load(const char* fn) { }//TODO: Format TBD
+constexpr char location_magic[] = "newman-location 1";
+constexpr char escape_magic[] = "newman-escape 1";
+constexpr char reference_magic[] = "newman-reference 2";
+
+//Square pixels; the view is described by its height so any aspect ratio can load it
+bool Mandelbrot::load(const char* fn) {
+  FILE* fp = fopen(fn, "r");
+  if (!fp) return false;
+
+  char buf[4096], re[4096], im[4096], height[4096];
+  int n, d = 2;
+  bool ok = (fgets(buf, sizeof(buf), fp) && !strncmp(buf, location_magic, strlen(location_magic))
+	     && fscanf(fp, " N %d re %4095s im %4095s height %4095s", &n, re, im, height) == 4);
+  if (ok && fscanf(fp, " power %d", &d) == 1) ok = (d >= 2 && d <= max_power); //Optional; 2 if absent
+  fclose(fp);
+  if (!ok) return false;
+
+  N = n;
+  power = d;
+  sz.im = height;
+  sz.im /= rows();
+  sz.re = sz.im;
+  setPrecision();
+  center.re = re;
+  center.im = im;
+  return true;
+}
+
+bool Mandelbrot::save(const char* fn) const {
+  FILE* fp = fopen(fn, "w");
+  if (!fp) return false;
+
+  mpf_class height = sz.im * rows();
+  fprintf(fp, "%s\nN %d\nre ", location_magic, N);
+  mpf_out_str(fp, 10, 0, center.re.get_mpf_t());
+  fprintf(fp, "\nim ");
+  mpf_out_str(fp, 10, 0, center.im.get_mpf_t());
+  fprintf(fp, "\nheight ");
+  mpf_out_str(fp, 10, 0, height.get_mpf_t());
+  fprintf(fp, "\n");
+  if (power != 2) fprintf(fp, "power %d\n", power);
+  fclose(fp);
+  return true;
+}
+
+bool Mandelbrot::saveEscapes(const char* fn) const {
+  FILE* fp = fopen(fn, "wb");
+  if (!fp) return false;
+
+  fprintf(fp, "%s\n%d %d %d\n", escape_magic, N, grid.nr, grid.nc);
+  fwrite(grid.values.data(), sizeof(RenderGrid::EscapeValue), grid.values.size(), fp);
+  fclose(fp);
+  return true;
+}
+
+bool Mandelbrot::loadEscapes(const char* fn, int r0, int c0) {
+  FILE* fp = fopen(fn, "rb");
+  if (!fp) return false;
+
+  char buf[256];
+  int n, nr, nc;
+  bool ok = (fgets(buf, sizeof(buf), fp) && !strncmp(buf, escape_magic, strlen(escape_magic))
+	     && fscanf(fp, "%d %d %d", &n, &nr, &nc) == 3 && fgetc(fp) == '\n'
+	     && r0 >= 0 && c0 >= 0 && r0 + nr <= rows() && c0 + nc <= cols());
+  for (int r = 0; ok && r < nr; r++)
+    ok = (fread(&grid.at(r0 + r, c0), sizeof(RenderGrid::EscapeValue), nc, fp) == nc);
+  fclose(fp);
+  return ok;
+}
 
-void Mandelbrot::save(const char* fn) { }//TODO: Format TBD
+bool Mandelbrot::writeRows(FILE* fp, int r0, int r1) const {
+  size_t count = (size_t)(r1 - r0) * cols();
+  return fwrite(&grid.at(r0, 0), sizeof(RenderGrid::EscapeValue), count, fp) == count;
+}
+
+bool Mandelbrot::readRows(FILE* fp, int r0, int r1) {
+  size_t count = (size_t)(r1 - r0) * cols();
+  return r0 >= 0 && r1 <= rows() && fread(&grid.at(r0, 0), sizeof(RenderGrid::EscapeValue), count, fp) == count;
+}
+
+//Hexadecimal keeps the orbit exact (writeHex writes a decimal exponent, hence base -16
+//when reading back). One line per iteration; the series is cheap to derive again from X
+bool Mandelbrot::saveReference(const char* fn) const {
+  FILE* fp = fopen(fn, "w");
+  if (!fp) return false;
+
+  static const std::vector<HPComplex> none;
+  const std::vector<HPComplex>& X = reference? reference->X : none;
+  int prec = X.empty()? 64 : X[0].re.get_prec();
+  fprintf(fp, "%s\n%d %d\n", reference_magic, prec, (int)X.size());
+  for (int i = 0; i < X.size(); i++) {
+    writeHex(fp, X[i].re);
+    fprintf(fp, " ");
+    writeHex(fp, X[i].im);
+    fprintf(fp, "\n");
+  }
+  
+  fclose(fp);
+  return true;
+}
+
+bool Mandelbrot::loadReference(const char* fn) {
+  FILE* fp = fopen(fn, "r");
+  if (!fp) return false;
+
+  char buf[256];
+  int prec, n;
+  if (!fgets(buf, sizeof(buf), fp) || strncmp(buf, reference_magic, strlen(reference_magic))
+      || fscanf(fp, "%d %d", &prec, &n) != 2 || prec < 1 || n < 1) { //Every user reads X[0]
+    fclose(fp);
+    return false;
+  }
+
+  std::vector<char> token(prec / 4 + 64);
+  sprintf(buf, "%%%ds", (int)token.size() - 1);
+  
+  std::vector<HPComplex> values(n);
+  bool ok = true;
+  for (int i = 0; ok && i < values.size(); i++)
+    for (mpf_class* v : {&values[i].re, &values[i].im}) {
+      v->set_prec(prec);
+      ok = (fscanf(fp, buf, token.data()) == 1 && !v->set_str(token.data(), -16));
+      if (!ok) break;
+    }
+  fclose(fp);
+  if (!ok) return false;
+
+  reference = std::make_shared<Reference>(std::move(values), power);
+  series.reset();
+  prepareApproximations();
+  fixed_reference = true;
+  return true;
+}
@@ -3,26 +3,95 @@
 
 #include "grid.h"
 #include "complex.h"
+#include "stats.h"
+#include "perturb.h"
+#include "floatexp.h"
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
 
 class Mandelbrot {
+public:
+  enum Arithmetic {AUTO, HARDWARE, LONG_DOUBLE, DOUBLE_DOUBLE, PERTURBATION};
+  
 protected:
+  //One formula's and arithmetic tier's loops, chosen once per render
+  class Kernel {
+  public:
+    bool (Mandelbrot::*orbit)(const HPComplex& X0, std::vector<HPComplex>& X, const std::function<bool()>& keep_going) const;
+    void (Mandelbrot::*row)(int r, int c0, int c1, RenderStats& stats); //Samples c0 to c1 - 1
+    RenderGrid::EscapeValue (Mandelbrot::*point)(const HPComplex& Y0, RenderStats& stats);
+    bool series;
+  };
+  
+  //An orbit and what derives from it alone: built once, then shared read-only by every
+  //instance that renders from it, on any thread
+  class Reference {
+  public:
+    std::vector<HPComplex> X;
+    std::vector<LPComplex> Xd; //X descended, for the per-pixel loops
+    int power;                 //The formula X was computed for
+
+    Reference(std::vector<HPComplex>&& X, int power);
+  };
+
+  class Series {
+  public:
+    std::vector<FEComplex> S; //Coefficients, order per iteration of the reference
+    int order;
+  };
+
   RenderGrid grid;
-  std::vector<HPComplex> X, A, B, C;
+  std::shared_ptr<const Reference> reference;
+  std::shared_ptr<const Series> series;
+  std::vector<LPComplex> Sd; //The series scaled for this view (see approximate)
+  double series_scale;       //A power of two near the pixel size
+  BLATable bla;              //Over the reference, for this view's largest delta
+  bool fixed_reference; //Reference orbit was taken from another instance
 
+  int requiredPrecision() const; //Bits, from the pixel size
   void setPrecision();
-  bool isUnstable(const LPComplex& bterm, const LPComplex& cterm);
+  bool canServe(int power, int length, mp_bitcnt_t prec, const HPComplex& X0) const; //Whether such an orbit can
+  bool reuseReference(); //Keeps the last reference if it can serve this view
+  bool loadCachedReference(); //From reference_cache, if an orbit there can serve this view
   
   bool inCardioid(const HPComplex& Z);
-  void findProbe();
-  void computeOrbit(const HPComplex& X0);
+  //The longest orbit, or none if keep_going stopped the search
+  std::vector<HPComplex> findProbe(const Kernel& kernel, const std::function<bool()>& keep_going);
+  template <class F> bool computeOrbit(const HPComplex& X0, std::vector<HPComplex>& X,
+				       const std::function<bool()>& keep_going) const;
   void computeSeries();
-  RenderGrid::EscapeValue getIterations(const HPComplex& Y0);
-  RenderGrid::EscapeValue getIterationsHW(const HPComplex& Y0);
+  void prepareApproximations(); //Series, computed if missing or of another order, and BLA for this view
+
+  //Pixels as double deltas from the reference's X[0]; point(i) gives the exact coordinate, for the few that need it
+  template <class F> void perturbPoints(const LPComplex* delta0, const std::function<HPComplex(int)>& point,
+					RenderGrid::EscapeValue* escapes, int count, RenderStats& stats);
+  template <class F> RenderGrid::EscapeValue finishPerturbation(const std::function<HPComplex(int)>& point,
+								const PerturbItem& item, RenderStats& stats);
+  template <class F> RenderGrid::EscapeValue iterateHP(const HPComplex& Y0, HPComplex Y, int n, RenderStats& stats);
+  template <class F> RenderGrid::EscapeValue getIterations(const HPComplex& Y0, RenderStats& stats);
+  template <class F, typename Real> RenderGrid::EscapeValue getIterationsHW(const HPComplex& Y0, RenderStats& stats);
+  template <class F> void computeRowPerturbation(int r, int c0, int c1, RenderStats& stats);
+  template <class F, typename Real> void computeRowHW(int r, int c0, int c1, RenderStats& stats);
+
+  template <class F> Kernel kernelFor() const;
+  Kernel kernel() const; //For this render's power and arithmetic
+  void computeRow(int r, const Kernel& kernel, RenderStats& stats);
+  void computeRow(int r, int c0, int c1, const Kernel& kernel, RenderStats& stats);
+  bool copyMirror(int r, int sum, RenderStats& stats);
   
 public:
   double error_tolerance;
+  int series_order; //Terms of the series approximation, from 2 to max_series_order
   int N;
+  int power; //z -> z^power + c, from 2 to max_power
   HPComplex center, sz;
+  RenderStats stats; //Since the last precompute; recolor time is added by callers
+  Arithmetic forced_arithmetic; //AUTO picks by depth
+  int lanes; //SIMD lanes for the perturbation kernel; 1 is scalar
+  bool bilinear; //Skip iterations with BLA and rebase pixels, rather than stepping every one
+  std::string reference_cache; //Directory keeping slow reference orbits between runs; empty for none
 
   Mandelbrot();
   Mandelbrot(int nr, int nc);
@@ -30,26 +99,65 @@ public:
   //TODO: Remove legacy functionality
   void loadLegacy(const char* fn);
   
+  inline mp_bitcnt_t precision() const {return center.re.get_prec();} //Bits for this view's coordinates
   inline int rows() const {return grid.nr;}
   inline int cols() const {return grid.nc;}
+  //Up to N, though a reused orbit may run longer
+  inline int referenceLength() const {return reference? std::min((int)reference->X.size(), N) : 0;}
+
+  void setView(const HPComplex& center, const HPComplex& sz);
+  void setReference(const Mandelbrot& source); //Shares its orbit, which must serve this view
+  bool canShare(const Mandelbrot& source) const; //Whether source has an orbit that serves this view
+  bool offerReference(const Mandelbrot& source); //Takes source's orbit for precompute unless ours serves already
 
-  bool useHardware();
-  void precompute();
+  Arithmetic arithmetic() const;
+  static const char* arithmeticName(Arithmetic arithmetic);
+  bool useHardware() const; //Any tier without a reference orbit
+  //Finds the reference orbit, checking keep_going as it goes. If that stops it, there is no
+  //orbit to render from, and it returns false.
+  bool precompute(const std::function<bool()>& keep_going = nullptr);
   void computeRow(int r);
+  void computeRow(int r, RenderStats& stats);
+  void computeRow(int r, int c0, int c1); //Samples c0 to c1 - 1 only
+
+  //The set is symmetric about the real axis, so when the view straddles it, rows r and
+  //mirrorSum() - r escape alike. Returns -1 when no two rows mirror each other.
+  int mirrorSum() const;
+  bool copyMirror(int r); //From the row above that mirrors it, if any; for renders that go top down
+  RenderGrid::EscapeValue computePoint(const HPComplex& pt);
+
+  //Computes every row on nthreads threads, including the calling one, which reports
+  //rows done to progress between its rows. Returns false if progress cancelled.
+  bool computeRows(int nthreads, const std::function<bool(int)>& progress = nullptr);
+  //Rows r0 to r1 - 1. Rows above r0 must be done already, since rows mirroring them are copied.
+  bool computeRows(int r0, int r1, int nthreads, const std::function<bool(int)>& progress = nullptr);
+
+  //Sets N, up to max_N, from a coarse render raised from N / 2 until it stops finding escapes, or
+  //finds none after a few doublings. Returns it.
+  int autoN(int max_N, int nthreads);
 
   HPComplex pointAt(int r, int c, int sc = 1) const;
   void translate(int dr, int dc, int sc = 1);
   void zoom(float scale);
   void zoomAt(float scale, int r, int c, int sc = 1);
+  void zoomedView(float scale, int r, int c, int sc, HPComplex& center, HPComplex& sz) const; //Where zoomAt would go
   
-  const RenderGrid::EscapeValue& at(int r, int c);
-  RenderGrid::EscapeValue at(int r, int c, int sc); //Averages values
+  const RenderGrid::EscapeValue& at(int r, int c) const;
+  inline const RenderGrid& escapes() const {return grid;}
+  void paste(const RenderGrid& source, int dr, int dc); //Sample (r + dr, c + dc) of source to (r, c), where both exist
+  RenderGrid::EscapeValue at(int r, int c, int sc) const; //Averages values
   
   void scaleUp(int sc);   //By duplicating values.
   void scaleDown(int sc); //By averaging values.
 
-  void load(const char* fn);
-  void save(const char* fn);
+  bool load(const char* fn);
+  bool save(const char* fn) const;
+  bool saveEscapes(const char* fn) const;
+  bool loadEscapes(const char* fn, int r0 = 0, int c0 = 0); //Into the grid at (r0, c0)
+  bool writeRows(FILE* fp, int r0, int r1) const; //Raw escapes of rows r0 to r1 - 1
+  bool readRows(FILE* fp, int r0, int r1);
+  bool saveReference(const char* fn) const;
+  bool loadReference(const char* fn);
 };
 
 #endif
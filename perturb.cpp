@@ -0,0 +1,388 @@
+#include "perturb.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+//Built with -ffp-contract=off, so every kernel rounds the same way and tiles rendered on
+//different machines match.
+
+constexpr double glitch_tolerance = 1e-6; //Squared; the pixel is within 1e-3 |X| of zero
+
+template <class F>
+static void perturbItem(const LPComplex* X, int lim, int N, PerturbItem& item) {
+  LPComplex d = item.delta, d0 = item.delta0, y;
+  int n = item.n, start = n;
+  double mag;
+
+  for (;;) {
+    if (n + 1 >= lim) {
+      item.status = (n >= N - 1)? PerturbItem::MAXED : PerturbItem::DETACHED;
+      break;
+    }
+
+    F::perturb(X[n].re, X[n].im, d.re, d.im, d0.re, d0.im);
+    n++;
+
+    y = X[n] + d;
+    mag = sqMag(y);
+    if (mag > bailout2) {
+      item.status = PerturbItem::ESCAPED;
+      break;
+    }
+    if (mag < glitch_tolerance * sqMag(X[n])) {
+      item.status = PerturbItem::DETACHED;
+      break;
+    }
+  }
+
+  item.n = item.m = n;
+  item.delta = d;
+  item.steps = n - start;
+}
+
+template <class F>
+static void perturbScalar(const LPComplex* X, int len, int N, const BLATable*, PerturbItem* items, int count) {
+  int lim = std::min(len, N);
+  for (int i = 0; i < count; i++)
+    perturbItem<F>(X, lim, N, items[i]);
+}
+
+//GCC won't size a vector by a template parameter
+template <int W> class Lanes;
+
+template <> class Lanes<2> {
+public:
+  typedef double vd __attribute__((vector_size(16)));
+  typedef long long vm __attribute__((vector_size(16)));
+};
+
+template <> class Lanes<4> {
+public:
+  typedef double vd __attribute__((vector_size(32)));
+  typedef long long vm __attribute__((vector_size(32)));
+};
+
+template <> class Lanes<8> {
+public:
+  typedef double vd __attribute__((vector_size(64)));
+  typedef long long vm __attribute__((vector_size(64)));
+};
+
+//W pixels at a time, each at its own iteration, so the reference is gathered per lane
+template <int W, class F>
+static void perturbLanes(const LPComplex* X, int len, int N, const BLATable*, PerturbItem* items, int count) {
+  typedef typename Lanes<W>::vd vd;
+  typedef typename Lanes<W>::vm vm;
+
+  vd dr, di, d0r, d0i, xr, xi, yr, yi, mag;
+  vm n, live, done; //live is -1 in lanes with an item, as comparisons give
+  int slot[W], next = 0, active = 0, lim = std::min(len, N);
+
+  //Loads the next unfinished item into lane l, or idles the lane
+  auto fill = [&](int l) {
+    for (; next < count; next++) {
+      PerturbItem& item = items[next];
+      if (item.n + 1 >= lim) {
+	item.status = (item.n >= N - 1)? PerturbItem::MAXED : PerturbItem::DETACHED;
+	continue;
+      }
+      slot[l] = next++;
+      n[l] = item.n;
+      live[l] = -1;
+      dr[l] = item.delta.re; di[l] = item.delta.im;
+      d0r[l] = item.delta0.re; d0i[l] = item.delta0.im;
+      xr[l] = X[n[l]].re; xi[l] = X[n[l]].im;
+      active++;
+      return;
+    }
+    slot[l] = -1;
+    n[l] = live[l] = 0;
+    dr[l] = di[l] = d0r[l] = d0i[l] = 0.0;
+    xr[l] = X[0].re; xi[l] = X[0].im;
+  };
+
+  for (int l = 0; l < W; l++) fill(l);
+
+  while (active) {
+    F::perturb(xr, xi, dr, di, d0r, d0i);
+    n -= live;
+
+    for (int l = 0; l < W; l++) {
+      xr[l] = X[n[l]].re;
+      xi[l] = X[n[l]].im;
+    }
+
+    yr = xr + dr;
+    yi = xi + di;
+    mag = yr * yr + yi * yi;
+    done = live & ((mag > bailout2) | (mag < glitch_tolerance * (xr * xr + xi * xi)) | (n + 1 >= lim));
+
+    long long any = 0;
+    for (int l = 0; l < W; l++) any |= done[l];
+    if (!any) continue;
+
+    for (int l = 0; l < W; l++) {
+      if (!done[l]) continue;
+
+      PerturbItem& item = items[slot[l]];
+      item.steps = n[l] - item.n;
+      item.n = item.m = n[l];
+      item.delta = LPComplex(dr[l], di[l]);
+      if (mag[l] > bailout2) item.status = PerturbItem::ESCAPED;
+      else if (n[l] + 1 < lim) item.status = PerturbItem::DETACHED;
+      else item.status = (n[l] >= N - 1)? PerturbItem::MAXED : PerturbItem::DETACHED;
+
+      active--;
+      fill(l);
+    }
+  }
+}
+
+template <class F>
+static void perturbBilinear(const LPComplex* X, int len, int N, const BLATable* bla, PerturbItem* items, int count) {
+  for (int i = 0; i < count; i++) {
+    PerturbItem& item = items[i];
+    LPComplex z = item.delta, d0 = item.delta0, y;
+    int n = item.n, m = item.m, l;
+    double mag;
+
+    for (;; item.steps++) {
+      y = X[m] + z;
+      mag = sqMag(y);
+      if (mag > bailout2) {
+	item.status = PerturbItem::ESCAPED;
+	break;
+      }
+      if (n >= N - 1) {
+	item.status = PerturbItem::MAXED;
+	break;
+      }
+
+      //The pixel itself becomes the delta, from the zero the orbit starts at before X[0]
+      if (mag < sqMag(z) || m >= len - 1) {
+	z = y;
+	F::step(z.re, z.im, d0.re, d0.im);
+	m = 0;
+	n++;
+	item.rebases++;
+	continue;
+      }
+
+      if (const BLATable::Step* step = bla->find(m, sqMag(z), std::min(N - 1 - n, len - 1 - m), l)) {
+	z = step->A * z + step->B * d0;
+	m += l;
+	n += l;
+      }
+      else {
+	F::perturb(X[m].re, X[m].im, z.re, z.im, d0.re, d0.im);
+	m++;
+	n++;
+      }
+    }
+
+    item.n = n;
+    item.m = m;
+    item.delta = z;
+  }
+}
+
+//The one-step map from m is z -> power X^(power - 1) z + delta0, good while the dropped terms,
+//led by (power choose 2) X^(power - 2) z^2, stay below epsilon times the linear one
+void BLATable::build(const LPComplex* X, int len, int power, double max_delta0, double epsilon) {
+  levels.clear();
+  if (len < 2) return;
+
+  levels.emplace_back(len - 1);
+  for (int m = 0; m < len - 1; m++) {
+    Step& step = levels[0][m];
+    LPComplex p(1.0, 0.0);
+    for (int k = 1; k < power; k++) p = p * X[m];
+    step.A = LPComplex(power * p.re, power * p.im);
+    step.B = LPComplex(1.0, 0.0);
+    double r = epsilon * sqrt(sqMag(X[m])) * 2.0 / (power - 1);
+    step.radius2 = r * r;
+  }
+
+  //x then y: valid where z is within x's radius and x's result within y's
+  while (levels.back().size() > 1) {
+    const std::vector<Step>& below = levels.back();
+    std::vector<Step> level(below.size() / 2);
+    for (size_t k = 0; k < level.size(); k++) {
+      const Step &x = below[2 * k], &y = below[2 * k + 1];
+      Step& step = level[k];
+      step.A = y.A * x.A;
+      step.B = y.A * x.B + y.B;
+      double ax = sqrt(sqMag(x.A)), r = (sqrt(y.radius2) - sqrt(sqMag(x.B)) * max_delta0) / ax;
+      r = std::min(sqrt(x.radius2), r);
+      step.radius2 = (r > 0.0 && std::isfinite(sqMag(step.A)) && std::isfinite(sqMag(step.B)))? r * r : 0.0;
+    }
+    levels.push_back(std::move(level));
+  }
+}
+
+LPComplex seriesDelta(const LPComplex* S, int order, int i, double scale, const LPComplex& eps) {
+  LPComplex e(eps.re / scale, eps.im / scale), sum;
+  const LPComplex* s = S + i * order;
+  for (int k = order - 1; k >= 0; k--)
+    sum = (sum + s[k]) * e;
+  return sum;
+}
+
+//The series scan ends where it stops being stable, or stops being finite
+static int seriesEnd(int i) {return std::max(i - 3, 1) - 1;}
+
+//Terms are compared by |re| + |im|, which can't underflow the way a square would
+static inline double magnitude(const LPComplex& z) {return fabs(z.re) + fabs(z.im);}
+
+static void approximateScalar(const LPComplex* S, int order, int len, double scale, double root_tolerance,
+			      PerturbItem& item) {
+  LPComplex e(item.delta0.re / scale, item.delta0.im / scale), power[max_series_order], t, sum;
+  int found = len - 1;
+  double below = 0.0;
+
+  power[0] = e;
+  for (int k = 1; k < order; k++) power[k] = power[k - 1] * e;
+  
+  for (int i = 1; i < len; i++) {
+    const LPComplex* s = S + i * order;
+    sum = LPComplex();
+    for (int k = 0; k < order; k++) {
+      below = magnitude(t);
+      t = s[k] * power[k];
+      sum = sum + t;
+    }
+    if (!(magnitude(t) <= below * root_tolerance) || !(magnitude(sum) <= DBL_MAX)) {
+      found = seriesEnd(i);
+      break;
+    }
+  }
+
+  item.n = item.m = found;
+  item.delta = seriesDelta(S, order, found, scale, item.delta0);
+}
+
+//W pixels at a time, all at the same term, so the coefficients are broadcast
+template <int W>
+static void approximateLanes(const LPComplex* S, int order, int len, double scale, double root_tolerance,
+			     PerturbItem* items, int count) {
+  typedef typename Lanes<W>::vd vd;
+  typedef typename Lanes<W>::vm vm;
+  const long long abs = 0x7fffffffffffffffLL; //Clears the sign bit
+
+  for (int first = 0; first < count; first += W) {
+    int w = std::min(W, count - first);
+    vd pr[max_series_order], pi[max_series_order], tr, ti, sr, si, below = {};
+    vm running, stop;
+    int found[W];
+
+    for (int l = 0; l < W; l++) {
+      LPComplex e = (l < w)? items[first + l].delta0 : LPComplex(), p;
+      p = e = LPComplex(e.re / scale, e.im / scale);
+      for (int k = 0; k < order; k++, p = p * e) {
+	pr[k][l] = p.re;
+	pi[k][l] = p.im;
+      }
+      running[l] = (l < w)? -1 : 0;
+      found[l] = len - 1;
+    }
+
+    for (int i = 1; i < len; i++) {
+      const LPComplex* s = S + i * order;
+      tr = ti = sr = si = vd{};
+      for (int k = 0; k < order; k++) {
+	below = (vd)((vm)tr & abs) + (vd)((vm)ti & abs);
+	tr = s[k].re * pr[k] - s[k].im * pi[k];
+	ti = s[k].re * pi[k] + s[k].im * pr[k];
+	sr = sr + tr;
+	si = si + ti;
+      }
+      stop = running & (~((vd)((vm)tr & abs) + (vd)((vm)ti & abs) <= below * root_tolerance)
+			| ~((vd)((vm)sr & abs) + (vd)((vm)si & abs) <= DBL_MAX));
+
+      long long any = 0, left = 0;
+      for (int l = 0; l < W; l++) any |= stop[l];
+      if (!any) continue;
+
+      for (int l = 0; l < W; l++)
+	if (stop[l]) found[l] = seriesEnd(i);
+      running &= ~stop;
+      for (int l = 0; l < W; l++) left |= running[l];
+      if (!left) break;
+    }
+
+    for (int l = 0; l < w; l++) {
+      PerturbItem& item = items[first + l];
+      item.n = item.m = found[l];
+      item.delta = seriesDelta(S, order, found[l], scale, item.delta0);
+    }
+  }
+}
+
+void approximate(const LPComplex* S, int order, int len, double scale, double tolerance,
+		 PerturbItem* items, int count, int lanes) {
+  double root_tolerance = sqrt(tolerance);
+#if defined(__x86_64__) || defined(__i386__)
+  if (lanes >= 8) return approximateLanes<8>(S, order, len, scale, root_tolerance, items, count);
+  if (lanes >= 4) return approximateLanes<4>(S, order, len, scale, root_tolerance, items, count);
+#endif
+  if (lanes >= 2) return approximateLanes<2>(S, order, len, scale, root_tolerance, items, count);
+  for (int i = 0; i < count; i++)
+    approximateScalar(S, order, len, scale, root_tolerance, items[i]);
+}
+
+//Instantiated here rather than inlined into target-specific wrappers, since GCC lowers the
+//vector operations of a template for the target it was defined under
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq")
+template void approximateLanes<8>(const LPComplex*, int, int, double, double, PerturbItem*, int);
+template void perturbLanes<8, Multibrot<2>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<8, Multibrot<3>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<8, Multibrot<4>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<8, Multibrot<5>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+template void approximateLanes<4>(const LPComplex*, int, int, double, double, PerturbItem*, int);
+template void perturbLanes<4, Multibrot<2>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<4, Multibrot<3>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<4, Multibrot<4>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+template void perturbLanes<4, Multibrot<5>>(const LPComplex*, int, int, const BLATable*, PerturbItem*, int);
+#pragma GCC pop_options
+#endif
+
+template <class F>
+static PerturbKernel perturbKernel(int lanes, bool bilinear) {
+  if (bilinear) return perturbBilinear<F>; //Pixels part ways too soon for lanes to pay off
+#if defined(__x86_64__) || defined(__i386__)
+  if (lanes >= 8) return perturbLanes<8, F>;
+  if (lanes >= 4) return perturbLanes<4, F>;
+#endif
+  if (lanes >= 2) return perturbLanes<2, F>;
+  return perturbScalar<F>;
+}
+
+PerturbKernel perturbKernel(int power, int lanes, bool bilinear) {
+  static_assert(max_power == 5, "Instantiate the kernels for every power");
+  switch (power) {
+  case 3: return perturbKernel<Multibrot<3>>(lanes, bilinear);
+  case 4: return perturbKernel<Multibrot<4>>(lanes, bilinear);
+  case 5: return perturbKernel<Multibrot<5>>(lanes, bilinear);
+  default: return perturbKernel<Multibrot<2>>(lanes, bilinear);
+  }
+}
+
+static int detectLanes() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) return 8;
+  if (__builtin_cpu_supports("avx2")) return 4;
+#endif
+  return 2;
+}
+
+int vectorLanes() {
+  static const int lanes = detectLanes();
+  return lanes;
+}
@@ -0,0 +1,93 @@
+#ifndef _BPJ_NEWMAN_PERTURB_H
+#define _BPJ_NEWMAN_PERTURB_H
+
+#include "formula.h"
+#include <algorithm>
+#include <vector>
+
+//One pixel's delta from the reference orbit at iteration m, for its own iteration n
+class PerturbItem {
+public:
+  enum Status {RUNNING, ESCAPED, MAXED, DETACHED}; //DETACHED: continue in high precision from n
+
+  int index; //The caller's, e.g. a column
+  int n, m;  //m is n until the pixel is rebased onto the start of the orbit
+  LPComplex delta, delta0;
+  Status status;
+  int steps, rebases; //Counted by the kernel; a bilinear step covers many iterations
+
+  PerturbItem() : index(0), n(0), m(0), status(RUNNING), steps(0), rebases(0) { }
+  PerturbItem(int index, int n, const LPComplex& delta, const LPComplex& delta0)
+    : index(index), n(n), m(n), delta(delta), delta0(delta0), status(RUNNING), steps(0), rebases(0) { }
+};
+
+/*
+ * Bilinear approximation: level j holds, for every m divisible by 2^j, the map from a delta
+ * at m to the delta 2^j iterations later, z -> A z + B delta0, along with the largest |z| (as
+ * its square) for which the dropped terms stay below epsilon for every delta0 up to
+ * max_delta0. Each level merges pairs from the one below.
+ */
+class BLATable {
+public:
+  class Step {
+  public:
+    LPComplex A, B;
+    double radius2;
+  };
+
+  std::vector<std::vector<Step>> levels;
+
+  void build(const LPComplex* X, int len, int power, double max_delta0, double epsilon);
+  inline void clear() {levels.clear();}
+  inline bool empty() const {return levels.empty();}
+
+  //The longest step from m that holds for a delta with squared magnitude z2 and is at most
+  //limit long, or NULL. Sets len to its length.
+  inline const Step* find(int m, double z2, int limit, int& len) const {
+    int j = std::min((int)levels.size() - 1, m? __builtin_ctz(m) : 31);
+    for (; j >= 0; j--) {
+      if ((1 << j) > limit || (m >> j) >= (int)levels[j].size()) continue;
+      const Step& step = levels[j][m >> j];
+      if (z2 < step.radius2) {
+	len = 1 << j;
+	return &step;
+      }
+    }
+    return NULL;
+  }
+};
+
+constexpr int max_series_order = 16;
+
+/*
+ * The series gives the delta at iteration i as the sum of S[i * order + k - 1] (eps / scale)^k
+ * for k from 1 to order: its coefficients come pre-multiplied by scale^k, so at any depth they
+ * stay within double range.
+ *
+ * approximate finds, for every item from its delta0, the last iteration the series (of length
+ * len) can stand in for: a few before the first where the square of its highest term exceeds
+ * tolerance times the square of the one below. Sets each item's n and delta there. With more
+ * than one lane, groups of pixels walk the coefficients together.
+ */
+void approximate(const LPComplex* S, int order, int len, double scale, double tolerance,
+		 PerturbItem* items, int count, int lanes);
+
+LPComplex seriesDelta(const LPComplex* S, int order, int i, double scale, const LPComplex& eps);
+
+/*
+ * Iterates every item against the descended reference orbit X (of length len) until it
+ * escapes, reaches iteration N - 1 or can no longer be trusted in double precision: the
+ * reference ran out, or the pixel came close enough to zero to lose its delta's precision.
+ * With more than one lane, the SIMD kernel refills each lane as soon as its pixel is done.
+ *
+ * Given a BLA table, the kernel instead skips ahead with it wherever a step holds, and
+ * rebases a pixel onto the start of the orbit whenever it comes closer to zero than its
+ * delta or the reference runs out, so no pixel is left to finish in high precision.
+ */
+typedef void (*PerturbKernel)(const LPComplex* X, int len, int N, const BLATable* bla, PerturbItem* items, int count);
+
+PerturbKernel perturbKernel(int power, int lanes, bool bilinear);
+
+int vectorLanes(); //Widest kernel the CPU supports
+
+#endif
@@ -0,0 +1,224 @@
+#include "pyramid.h"
+#include "colorize.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char pyramid_magic[] = "newman-pyramid 1";
+
+static bool readFile(const std::string& fn, std::string& contents) {
+  FILE* fp = fopen(fn.c_str(), "rb");
+  if (!fp) return false;
+  contents.clear();
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) contents.append(buf, n);
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+static bool isNumber(const char* str) {return *str && strspn(str, "0123456789") == strlen(str);}
+
+TilePyramid::TilePyramid(const std::string& dir, const Mandelbrot& location, int tile, int sc,
+			 const CachedPalette& pal, bool smooth, int max_level, size_t budget)
+  : dir(dir), center(location.center), N(location.N), power(location.power), series_order(location.series_order),
+    tile(tile), sc(sc), max_level(std::min(max_level, 60)), error_tolerance(location.error_tolerance),
+    pal(pal), smooth(smooth), budget(budget), bytes(0) {
+  side.set_prec(location.sz.im.get_prec());
+  side = location.sz.im * location.rows();
+}
+
+std::string TilePyramid::key(int z, int x, int y) const {
+  return std::to_string(z) + "/" + std::to_string(x) + "/" + std::to_string(y);
+}
+
+std::string TilePyramid::path(int z, int x, int y) const {return dir + "/" + key(z, x, y) + ".png";}
+
+bool TilePyramid::valid(int z, int x, int y) const {
+  return z >= 0 && z <= max_level && x >= 0 && y >= 0 && x < (1L << z) && y < (1L << z);
+}
+
+bool TilePyramid::open(const std::string& palette) {
+  mkdir(dir.c_str(), 0777);
+  std::string fn = dir + "/pyramid.txt", tmp = fn + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "w");
+  if (!fp) return false;
+  fprintf(fp, "%s\n%d %d %d %.17g %d %d %d\n", pyramid_magic, N, power, series_order, error_tolerance,
+	  tile, sc, (int)smooth);
+  for (const mpf_class* v : {&side, &center.re, &center.im}) {
+    writeHex(fp, *v);
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "%s\n", palette.c_str());
+  fclose(fp);
+
+  std::string ours, theirs;
+  bool ok = readFile(tmp, ours);
+  if (ok && readFile(fn, theirs)) {
+    unlink(tmp.c_str());
+    if (ours != theirs) return false;
+  }
+  else if (!ok || rename(tmp.c_str(), fn.c_str())) return false;
+
+  scan();
+  return true;
+}
+
+//Tiles from earlier runs, oldest last; unfinished ones are removed
+void TilePyramid::scan() {
+  std::vector<std::pair<time_t, std::string>> found;
+  std::unordered_map<std::string, size_t> sizes;
+  DIR* dz = opendir(dir.c_str());
+  if (!dz) return;
+  while (struct dirent* ez = readdir(dz)) {
+    if (!isNumber(ez->d_name)) continue;
+    std::string zdir = dir + "/" + ez->d_name;
+    DIR* dx = opendir(zdir.c_str());
+    if (!dx) continue;
+    while (struct dirent* ex = readdir(dx)) {
+      if (!isNumber(ex->d_name)) continue;
+      std::string xdir = zdir + "/" + ex->d_name;
+      DIR* dy = opendir(xdir.c_str());
+      if (!dy) continue;
+      while (struct dirent* ey = readdir(dy)) {
+	std::string name = ey->d_name, fn = xdir + "/" + name;
+	struct stat st;
+	if (name[0] == '.' && name.size() > 4 && !name.compare(name.size() - 4, 4, ".png")) unlink(fn.c_str());
+	else if (name.size() > 4 && !name.compare(name.size() - 4, 4, ".png")
+		 && isNumber(name.substr(0, name.size() - 4).c_str()) && !stat(fn.c_str(), &st)) {
+	  std::string k = std::string(ez->d_name) + "/" + ex->d_name + "/" + name.substr(0, name.size() - 4);
+	  found.push_back(std::make_pair(st.st_mtime, k));
+	  sizes[k] = st.st_size;
+	}
+      }
+      closedir(dy);
+    }
+    closedir(dx);
+  }
+  closedir(dz);
+
+  std::sort(found.begin(), found.end(), std::greater<std::pair<time_t, std::string>>());
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& f : found) {
+    lru.push_back(f.second);
+    files[f.second] = std::make_pair(std::prev(lru.end()), sizes[f.second]);
+    bytes += sizes[f.second];
+  }
+  evict();
+}
+
+//With the mutex held
+void TilePyramid::evict() {
+  while (budget && bytes > budget && lru.size() > 1) {
+    const std::string& k = lru.back();
+    auto it = files.find(k);
+    bytes -= it->second.second;
+    unlink((dir + "/" + k + ".png").c_str());
+    files.erase(it);
+    lru.pop_back();
+  }
+}
+
+Mandelbrot TilePyramid::engine() const {
+  Mandelbrot mandel(tile * sc, tile * sc);
+  mandel.N = N;
+  mandel.power = power;
+  mandel.series_order = series_order;
+  mandel.error_tolerance = error_tolerance;
+  mandel.reference_cache = dir + "/references";
+  return mandel;
+}
+
+bool TilePyramid::render(int z, int x, int y, Mandelbrot& engine, size_t& size) {
+  TraceSpan span("tile");
+
+  //Samples are side / (tile * sc * 2^z) apart, and the tile's center is (x + 1/2, y + 1/2)
+  //tiles from the level's top left corner
+  HPComplex sz(side.get_prec());
+  sz.re = side / (tile * sc);
+  mpf_div_2exp(sz.re.get_mpf_t(), sz.re.get_mpf_t(), z);
+  sz.im = sz.re;
+  engine.setView(center, sz);
+
+  mpf_class half(0, engine.precision());
+  mpf_div_2exp(half.get_mpf_t(), side.get_mpf_t(), z + 1);
+  HPComplex pt(engine.precision());
+  pt.re = center.re + (2L * x + 1 - (1L << z)) * half;
+  pt.im = center.im - (2L * y + 1 - (1L << z)) * half;
+  engine.center.re = pt.re;
+  engine.center.im = pt.im;
+
+  engine.precompute();
+  engine.computeRows(1);
+
+  ByteImage img(tile, tile, 3);
+  for (int r = 0; r < tile; r++)
+    colorLine(pal, smooth, engine, sc, img, r);
+
+  //Saved under a name that says PNG, then moved into place whole
+  static std::atomic<int> counter(0);
+  std::string xdir = dir + "/" + std::to_string(z) + "/" + std::to_string(x);
+  std::string fn = path(z, x, y), tmp = xdir + "/." + std::to_string(y) + "-" + std::to_string(counter++) + ".png";
+  mkdir((dir + "/" + std::to_string(z)).c_str(), 0777);
+  mkdir(xdir.c_str(), 0777);
+  img.save_filename(tmp);
+
+  struct stat st;
+  if (stat(tmp.c_str(), &st) || rename(tmp.c_str(), fn.c_str())) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  size = st.st_size;
+  return true;
+}
+
+bool TilePyramid::get(int z, int x, int y, Mandelbrot& engine, std::string* png) {
+  if (!valid(z, x, y)) return false;
+  std::string k = key(z, x, y);
+
+  for (;;) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = files.find(k);
+    while (it == files.end() && rendering.count(k)) {
+      rendered.wait(lock);
+      it = files.find(k);
+    }
+
+    if (it != files.end()) {
+      lru.splice(lru.begin(), lru, it->second.first);
+      lock.unlock();
+      if (!png || readFile(path(z, x, y), *png)) return true;
+
+      //Evicted in between, or removed behind our back: forgotten, so it is rendered again
+      lock.lock();
+      it = files.find(k);
+      if (it != files.end()) {
+	bytes -= it->second.second;
+	lru.erase(it->second.first);
+	files.erase(it);
+      }
+      continue;
+    }
+
+    rendering.insert(k);
+    lock.unlock();
+    size_t size = 0;
+    bool ok = render(z, x, y, engine, size);
+
+    lock.lock();
+    rendering.erase(k);
+    if (ok) {
+      lru.push_front(k);
+      files[k] = std::make_pair(lru.begin(), size);
+      bytes += size;
+      evict();
+    }
+    rendered.notify_all();
+    if (!ok) return false;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef _BPJ_NEWMAN_PYRAMID_H
+#define _BPJ_NEWMAN_PYRAMID_H
+
+#include "mandelbrot.h"
+#include <byteimage/palette.h>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+using byteimage::CachedPalette;
+
+/*
+ * A location as square PNG tiles at every zoom level, for deep-zoom viewers. Level z is
+ * 2^z tiles across, covering the location's height; tile (z, x, y) is saved as z/x/y.png,
+ * counting x from the left and y from the top. Tiles are rendered the first time they are
+ * asked for and kept on disk, where the least recently used go first past the byte budget.
+ */
+
+class TilePyramid {
+protected:
+  std::string dir;
+  HPComplex center;
+  mpf_class side; //Of level 0
+  int N, power, series_order, tile, sc, max_level;
+  double error_tolerance;
+  CachedPalette pal;
+  bool smooth;
+  size_t budget; //Bytes of tiles on disk, or 0 for no limit
+
+  std::mutex mutex;
+  std::condition_variable rendered;
+  std::set<std::string> rendering;
+  std::list<std::string> lru; //Most recently used first
+  std::unordered_map<std::string, std::pair<std::list<std::string>::iterator, size_t>> files;
+  size_t bytes;
+
+  std::string key(int z, int x, int y) const;
+  void scan();
+  void evict();
+  bool render(int z, int x, int y, Mandelbrot& engine, size_t& size);
+
+public:
+  TilePyramid(const std::string& dir, const Mandelbrot& location, int tile, int sc,
+	      const CachedPalette& pal, bool smooth, int max_level, size_t budget);
+
+  //Records what the tiles show, or checks that tiles already there show the same.
+  //palette names the coloring, which the pyramid can't check by itself.
+  bool open(const std::string& palette);
+
+  inline int tileSize() const {return tile;}
+  inline int levels() const {return max_level + 1;}
+  bool valid(int z, int x, int y) const;
+  std::string path(int z, int x, int y) const;
+
+  //One per worker, kept across tiles so that nearby tiles share reference orbits
+  Mandelbrot engine() const;
+
+  //Renders the tile with engine unless it is on disk already, or waits if another thread is
+  //rendering it. If png is given, it gets the file's contents.
+  bool get(int z, int x, int y, Mandelbrot& engine, std::string* png = NULL);
+};
+
+#endif
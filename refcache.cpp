@@ -0,0 +1,188 @@
+#include "refcache.h"
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char index_magic[] = "newman-refcache 1";
+constexpr char orbit_magic[] = "newman-orbit 1";
+
+static std::mutex index_mutex; //Between engines in one process; across processes the last index written wins
+
+//Limbs as GMP holds them, so the value comes back exactly
+static bool writeValue(FILE* fp, const mpf_class& v) {
+  const __mpf_struct* f = v.get_mpf_t();
+  int size = f->_mp_size;
+  long exp = f->_mp_exp;
+  return (fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(&exp, sizeof(exp), 1, fp) == 1
+	  && fwrite(f->_mp_d, sizeof(mp_limb_t), std::abs(size), fp) == std::abs(size));
+}
+
+static bool readValue(FILE* fp, mpf_class& v, mp_bitcnt_t prec) {
+  v.set_prec(prec);
+  __mpf_struct* f = v.get_mpf_t();
+  int size;
+  long exp;
+  if (fread(&size, sizeof(size), 1, fp) != 1 || fread(&exp, sizeof(exp), 1, fp) != 1
+      || std::abs(size) > f->_mp_prec + 1
+      || fread(f->_mp_d, sizeof(mp_limb_t), std::abs(size), fp) != std::abs(size))
+    return false;
+  f->_mp_size = size;
+  f->_mp_exp = exp;
+  return true;
+}
+
+//FNV-1a, over the limbs so that values differing anywhere get different keys
+static unsigned long long hashBytes(unsigned long long h, const void* data, size_t n) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static unsigned long long hashValue(unsigned long long h, const mpf_class& v) {
+  const __mpf_struct* f = v.get_mpf_t();
+  h = hashBytes(h, &f->_mp_size, sizeof(f->_mp_size));
+  h = hashBytes(h, &f->_mp_exp, sizeof(f->_mp_exp));
+  return hashBytes(h, f->_mp_d, std::abs(f->_mp_size) * sizeof(mp_limb_t));
+}
+
+ReferenceCache::ReferenceCache(const std::string& dir) : dir(dir) { }
+
+unsigned long long ReferenceCache::viewKey(const HPComplex& center, const HPComplex& sz, int nr, int nc, int N, int power) {
+  int ints[] = {nr, nc, N, power};
+  unsigned long long h = hashBytes(0xcbf29ce484222325ULL, ints, sizeof(ints));
+  for (const mpf_class* v : {&center.re, &center.im, &sz.re, &sz.im}) h = hashValue(h, *v);
+  return h;
+}
+
+std::string ReferenceCache::indexPath() const {return dir + "/index.txt";}
+
+std::vector<ReferenceCache::Entry> ReferenceCache::readIndex() const {
+  std::vector<Entry> entries;
+  FILE* fp = fopen(indexPath().c_str(), "r");
+  if (!fp) return entries;
+
+  char buf[256], format[32];
+  if (fgets(buf, sizeof(buf), fp) && !strncmp(buf, index_magic, strlen(index_magic))) {
+    Entry entry;
+    unsigned long prec;
+    while (fscanf(fp, "%255s %d %d %d %lu %llx", buf, &entry.power, &entry.length, &entry.order, &prec, &entry.view) == 6) {
+      std::vector<char> token(prec / 4 + 64);
+      sprintf(format, "%%%ds", (int)token.size() - 1);
+      entry.file = buf;
+      entry.prec = prec;
+      bool ok = true;
+      for (mpf_class* v : {&entry.X0.re, &entry.X0.im}) {
+	v->set_prec(prec);
+	ok = ok && fscanf(fp, format, token.data()) == 1 && !v->set_str(token.data(), -16);
+      }
+      if (!ok) break;
+      entries.push_back(entry);
+    }
+  }
+  fclose(fp);
+  return entries;
+}
+
+bool ReferenceCache::writeIndex(const std::vector<Entry>& entries) const {
+  std::string tmp = indexPath() + "." + std::to_string(getpid());
+  FILE* fp = fopen(tmp.c_str(), "w");
+  if (!fp) return false;
+
+  fprintf(fp, "%s\n", index_magic);
+  for (const Entry& entry : entries) {
+    fprintf(fp, "%s %d %d %d %lu %016llx ", entry.file.c_str(), entry.power, entry.length, entry.order,
+	    (unsigned long)entry.prec, entry.view);
+    writeHex(fp, entry.X0.re);
+    fprintf(fp, " ");
+    writeHex(fp, entry.X0.im);
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  return !rename(tmp.c_str(), indexPath().c_str());
+}
+
+bool ReferenceCache::find(const std::function<bool(const Entry&)>& fits, Entry& entry) const {
+  std::vector<Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    entries = readIndex();
+  }
+  for (int i = (int)entries.size() - 1; i >= 0; i--)
+    if (fits(entries[i])) {
+      entry = entries[i];
+      return true;
+    }
+  return false;
+}
+
+bool ReferenceCache::load(const Entry& entry, std::vector<HPComplex>& X, std::vector<FEComplex>& S) const {
+  FILE* fp = fopen((dir + "/" + entry.file).c_str(), "rb");
+  if (!fp) return false;
+
+  char buf[256];
+  int power, length, order;
+  unsigned long prec;
+  bool ok = (fgets(buf, sizeof(buf), fp) && !strncmp(buf, orbit_magic, strlen(orbit_magic))
+	     && fscanf(fp, "%d %d %d %lu", &power, &length, &order, &prec) == 4 && fgetc(fp) == '\n'
+	     && power == entry.power && length == entry.length && order == entry.order && prec == entry.prec);
+  if (ok) {
+    X.resize(length);
+    for (int i = 0; ok && i < length; i++)
+      ok = readValue(fp, X[i].re, prec) && readValue(fp, X[i].im, prec);
+    S.resize((size_t)length * order);
+    ok = ok && fread(S.data(), sizeof(FEComplex), S.size(), fp) == S.size();
+  }
+  fclose(fp);
+  return ok;
+}
+
+bool ReferenceCache::store(const std::vector<HPComplex>& X, int power, const std::vector<FEComplex>& S, int order,
+			   unsigned long long view) {
+  if (X.empty() || S.size() != (size_t)X.size() * order) return false;
+  mkdir(dir.c_str(), 0777);
+
+  static int counter = 0;
+  char name[64];
+  Entry entry;
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    sprintf(name, "orbit-%d-%d-%d.dat", (int)time(NULL), (int)getpid(), counter++);
+  }
+  entry.file = name;
+  entry.power = power;
+  entry.length = X.size();
+  entry.order = order;
+  entry.prec = X[0].re.get_prec();
+  entry.view = view;
+  entry.X0.re.set_prec(entry.prec);
+  entry.X0.im.set_prec(entry.prec);
+  entry.X0.re = X[0].re;
+  entry.X0.im = X[0].im;
+
+  //Written in full before the index names it
+  std::string path = dir + "/" + entry.file, tmp = path + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp) return false;
+  fprintf(fp, "%s\n%d %d %d %lu\n", orbit_magic, power, entry.length, order, (unsigned long)entry.prec);
+  bool ok = true;
+  for (size_t i = 0; ok && i < X.size(); i++)
+    ok = writeValue(fp, X[i].re) && writeValue(fp, X[i].im);
+  ok = ok && fwrite(S.data(), sizeof(FEComplex), S.size(), fp) == S.size();
+  ok = !fclose(fp) && ok && !rename(tmp.c_str(), path.c_str());
+  if (!ok) {
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(index_mutex);
+  std::vector<Entry> entries = readIndex();
+  entries.push_back(entry);
+  while (entries.size() > max_entries) {
+    unlink((dir + "/" + entries.front().file).c_str());
+    entries.erase(entries.begin());
+  }
+  return writeIndex(entries);
+}
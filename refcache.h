@@ -0,0 +1,53 @@
+#ifndef _BPJ_NEWMAN_REFCACHE_H
+#define _BPJ_NEWMAN_REFCACHE_H
+
+#include "complex.h"
+#include "floatexp.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Reference orbits kept on disk between runs, so that a location seen before, or one near it,
+ * skips findProbe. The index lists what decides whether an orbit can serve a view (its
+ * formula, precision, length and starting point) without reading the orbit itself. Orbits
+ * are stored as raw limbs, with their series if they have one. Past max_entries, the oldest
+ * go first.
+ */
+
+class ReferenceCache {
+public:
+  class Entry {
+  public:
+    std::string file; //Within the cache directory
+    int power, length, order; //order is 0 without a series
+    mp_bitcnt_t prec;
+    unsigned long long view; //Key of the view it was found for
+    HPComplex X0;
+  };
+
+protected:
+  std::string dir;
+
+  std::string indexPath() const;
+  std::vector<Entry> readIndex() const;
+  bool writeIndex(const std::vector<Entry>& entries) const;
+
+public:
+  static constexpr int max_entries = 32;
+  static constexpr double min_seconds = 1.0; //Orbits found faster than this aren't worth the disk
+
+  ReferenceCache(const std::string& dir);
+
+  //Everything findProbe's choice depends on. An orbit that escaped before N can only serve the
+  //view it was found for, since findProbe might find a longer one anywhere else.
+  static unsigned long long viewKey(const HPComplex& center, const HPComplex& sz, int nr, int nc, int N, int power);
+
+  //The newest entry that fits, if any
+  bool find(const std::function<bool(const Entry&)>& fits, Entry& entry) const;
+  bool load(const Entry& entry, std::vector<HPComplex>& X, std::vector<FEComplex>& S) const;
+  bool store(const std::vector<HPComplex>& X, int power, const std::vector<FEComplex>& S, int order,
+	     unsigned long long view);
+};
+
+#endif
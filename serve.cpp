@@ -0,0 +1,297 @@
+#include "pyramid.h"
+#include "multiwave.h"
+#include "trace.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+//Drag to pan, scroll to zoom, over the server's own tiles
+static const char* index_html =
+  "<!DOCTYPE html>\n<html><head><title>newman</title><style>\n"
+  "body{margin:0;overflow:hidden;background:#000}#v{position:absolute;width:100%;height:100%;cursor:move}\n"
+  "#v img{position:absolute;image-rendering:pixelated;user-select:none;-webkit-user-drag:none}\n"
+  "</style></head><body><div id=\"v\"></div><script>\n"
+  "fetch('/info.json').then(r=>r.json()).then(info=>{\n"
+  " const v=document.getElementById('v'),T=info.tile_size;\n"
+  " let z=0,x=0,y=0,imgs={};\n"
+  " function fit(){z=0;x=(v.clientWidth-T)/2;y=(v.clientHeight-T)/2;}\n"
+  " function draw(){\n"
+  "  const n=1<<z,seen={};\n"
+  "  for(let ty=Math.max(0,Math.floor(-y/T));ty<Math.min(n,Math.ceil((v.clientHeight-y)/T));ty++)\n"
+  "   for(let tx=Math.max(0,Math.floor(-x/T));tx<Math.min(n,Math.ceil((v.clientWidth-x)/T));tx++){\n"
+  "    const k=z+'/'+tx+'/'+ty;seen[k]=1;\n"
+  "    if(!imgs[k]){imgs[k]=new Image();imgs[k].src='/'+k+'.png';v.appendChild(imgs[k]);}\n"
+  "    imgs[k].style.left=(x+tx*T)+'px';imgs[k].style.top=(y+ty*T)+'px';\n"
+  "   }\n"
+  "  for(const k in imgs)if(!seen[k]){v.removeChild(imgs[k]);delete imgs[k];}\n"
+  " }\n"
+  " let drag=null;\n"
+  " v.onmousedown=e=>{drag=[e.clientX-x,e.clientY-y];};\n"
+  " window.onmouseup=()=>{drag=null;};\n"
+  " window.onmousemove=e=>{if(drag){x=e.clientX-drag[0];y=e.clientY-drag[1];draw();}};\n"
+  " v.onwheel=e=>{e.preventDefault();\n"
+  "  const d=e.deltaY<0?1:-1;if(z+d<0||z+d>=info.levels)return;\n"
+  "  const f=d>0?2:0.5;x=e.clientX-(e.clientX-x)*f;y=e.clientY-(e.clientY-y)*f;z+=d;draw();};\n"
+  " window.onresize=draw;fit();draw();\n"
+  "});\n"
+  "</script></body></html>\n";
+
+static void usage() {
+  fprintf(stderr,
+	  "Usage: newman-serve [options] location\n"
+	  "Serves the location as a deep-zoom tile pyramid at http://address:port/z/x/y.png,\n"
+	  "rendering tiles as they are asked for, with a viewer at http://address:port/\n"
+	  "  location    File saved with F2, or in the newman-location format\n"
+	  "  -d dir      Tile directory (default tiles)\n"
+	  "  -e levels   Render every tile down to this level and exit, instead of serving\n"
+	  "  -l level    Deepest level served (default 40)\n"
+	  "  -m MB       Tiles kept on disk before the least recently used go (default 1024, 0 for no limit)\n"
+	  "  -a address  Address to listen on (default 127.0.0.1)\n"
+	  "  -P port     Port to listen on (default 8080)\n"
+	  "  -t n        Number of threads, each rendering its own tile (default: all cores)\n"
+	  "  -T n        Tile size in pixels (default 256)\n"
+	  "  -s n        n x n multisampling (default 1)\n"
+	  "  -n n        Iteration count, for every level (default: from location)\n"
+	  "  -k n        Terms of the series approximation, 2 to 16 (default 3)\n"
+	  "  -p file     Palette (default default.pal)\n"
+	  "  -S          Disable smoothing\n");
+}
+
+//The palette by its contents, so the tile directory notices a different one under the same name
+static std::string describePalette(const char* fn) {
+  FILE* fp = fopen(fn, "rb");
+  if (!fp) return "";
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  int ch;
+  while ((ch = fgetc(fp)) != EOF) h = (h ^ (unsigned char)ch) * 0x100000001b3ULL;
+  fclose(fp);
+  char buf[32];
+  sprintf(buf, "%016llx", h);
+  return std::string(fn) + " " + buf;
+}
+
+static bool sendAll(int fd, const char* data, size_t n) {
+  while (n > 0) {
+    ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+    if (sent <= 0) return false;
+    data += sent;
+    n -= sent;
+  }
+  return true;
+}
+
+static void respond(int fd, int status, const char* reason, const char* type, const std::string& body, bool head,
+		    const char* extra = "") {
+  char header[512];
+  int n = snprintf(header, sizeof(header),
+		   "HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: close\r\n\r\n",
+		   status, reason, type, body.size(), extra);
+  if (sendAll(fd, header, n) && !head) sendAll(fd, body.data(), body.size());
+}
+
+//Just the request line; the headers are read past and ignored
+static bool readRequest(int fd, std::string& method, std::string& target) {
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+    if (request.size() > 16384) return false;
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) return false;
+    request.append(buf, n);
+  }
+
+  char m[16], t[1024];
+  if (sscanf(request.c_str(), "%15s %1023s", m, t) != 2) return false;
+  method = m;
+  target = t;
+  size_t query = target.find('?');
+  if (query != std::string::npos) target.resize(query);
+  return true;
+}
+
+static void handle(int fd, TilePyramid& pyramid, Mandelbrot& engine) {
+  std::string method, target, body;
+  if (!readRequest(fd, method, target)) {
+    respond(fd, 400, "Bad Request", "text/plain", "Bad request\n", false);
+    return;
+  }
+  bool head = method == "HEAD";
+  if (method != "GET" && !head) {
+    respond(fd, 405, "Method Not Allowed", "text/plain", "Only GET and HEAD\n", false, "Allow: GET, HEAD\r\n");
+    return;
+  }
+
+  int z, x, y, n = 0;
+  if (target == "/" || target == "/index.html") respond(fd, 200, "OK", "text/html", index_html, head);
+  else if (target == "/info.json") {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\n  \"tile_size\": %d,\n  \"levels\": %d,\n  \"url\": \"/{z}/{x}/{y}.png\"\n}\n",
+	     pyramid.tileSize(), pyramid.levels());
+    respond(fd, 200, "OK", "application/json", buf, head);
+  }
+  else if (sscanf(target.c_str(), "/%d/%d/%d.png%n", &z, &x, &y, &n) == 3 && n == (int)target.size()
+	   && pyramid.valid(z, x, y)) {
+    Clock::time_point t = Clock::now();
+    if (pyramid.get(z, x, y, engine, &body)) {
+      respond(fd, 200, "OK", "image/png", body, head, "Cache-Control: max-age=86400\r\n");
+      if (secondsSince(t) > 0.1) fprintf(stderr, "Tile %d/%d/%d: %.3fs\n", z, x, y, secondsSince(t));
+    }
+    else respond(fd, 500, "Internal Server Error", "text/plain", "Could not render the tile\n", head);
+  }
+  else respond(fd, 404, "Not Found", "text/plain", "Not found\n", head);
+}
+
+static int serve(TilePyramid& pyramid, const char* address, int port, int nthreads) {
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (server < 0 || inet_pton(AF_INET, address, &addr.sin_addr) != 1
+      || setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))
+      || bind(server, (sockaddr*)&addr, sizeof(addr)) || listen(server, 64)) {
+    fprintf(stderr, "Could not listen on %s:%d\n", address, port);
+    return 1;
+  }
+  fprintf(stderr, "Serving %d levels of %dx%d tiles at http://%s:%d/\n", pyramid.levels(), pyramid.tileSize(),
+	  pyramid.tileSize(), address, port);
+
+  //Connections wait here for a worker, each with its own engine
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<int> pending;
+  std::vector<std::thread> workers;
+  for (int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread([&]() {
+	  Mandelbrot engine = pyramid.engine();
+	  for (;;) {
+	    int fd;
+	    {
+	      std::unique_lock<std::mutex> lock(mutex);
+	      while (pending.empty()) ready.wait(lock);
+	      fd = pending.front();
+	      pending.pop_front();
+	    }
+	    handle(fd, pyramid, engine);
+	    close(fd);
+	  }
+	}));
+
+  for (;;) {
+    int fd = accept(server, NULL, NULL);
+    if (fd < 0) continue;
+    timeval timeout = {10, 0}; //For reading the request, not for the render
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(fd);
+    }
+    ready.notify_one();
+  }
+}
+
+static int render(TilePyramid& pyramid, int levels, int nthreads) {
+  std::vector<int> first(levels + 2, 0); //Of each level, counting tiles from level 0
+  for (int z = 0; z <= levels; z++) first[z + 1] = first[z] + (1 << z) * (1 << z);
+  int total = first[levels + 1];
+
+  std::atomic<int> next(0), done(0), failed(0);
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> workers;
+  for (int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread([&]() {
+	  Mandelbrot engine = pyramid.engine();
+	  for (int j; (j = next++) < total;) {
+	    int z = std::upper_bound(first.begin(), first.end(), j) - first.begin() - 1, k = j - first[z];
+	    if (!pyramid.get(z, k % (1 << z), k / (1 << z), engine)) failed++;
+	    done++;
+	  }
+	}));
+
+  while (done < total) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    fprintf(stderr, "\rRendered tile %d / %d", (int)done, total);
+  }
+  for (auto& worker : workers) worker.join();
+  fprintf(stderr, "\rRendered tile %d / %d\n", total, total);
+  fprintf(stderr, "Total: %.3fs\n", secondsSince(start));
+
+  if (failed) {
+    fprintf(stderr, "Could not save %d tiles\n", (int)failed);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  const char *dir = "tiles", *address = "127.0.0.1", *palette_fn = "default.pal";
+  int port = 8080, export_levels = -1, max_level = 40, tile = 256, sc = 1, N = 0, order = 3, budget = 1024;
+  int nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+  bool smooth = true;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:e:l:m:a:P:t:T:s:n:k:p:S")) != -1)
+    switch (opt) {
+    case 'd': dir = optarg; break;
+    case 'e': export_levels = atoi(optarg); break;
+    case 'l': max_level = atoi(optarg); break;
+    case 'm': budget = atoi(optarg); break;
+    case 'a': address = optarg; break;
+    case 'P': port = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'T': tile = atoi(optarg); break;
+    case 's': sc = atoi(optarg); break;
+    case 'n': N = atoi(optarg); break;
+    case 'k': order = atoi(optarg); break;
+    case 'p': palette_fn = optarg; break;
+    case 'S': smooth = false; break;
+    default: usage(); return 1;
+    }
+  if (optind != argc - 1 || max_level < 0 || max_level > 60 || export_levels > 24 || budget < 0
+      || port < 1 || port > 65535 || nthreads < 1 || tile < 1 || sc < 1 || N < 0
+      || order < 2 || order > max_series_order) {
+    usage();
+    return 1;
+  }
+
+  const char* location_fn = argv[optind];
+  Mandelbrot location(600, 800);
+  FILE* fp = fopen(location_fn, "r");
+  if (!fp) {
+    fprintf(stderr, "Could not load from %s\n", location_fn);
+    return 1;
+  }
+  fclose(fp);
+  if (!location.load(location_fn)) location.loadLegacy(location_fn);
+  if (N) location.N = N;
+  location.series_order = order;
+
+  std::string palette = describePalette(palette_fn);
+  if (palette.empty()) {
+    fprintf(stderr, "Could not load from %s\n", palette_fn);
+    return 1;
+  }
+  MultiWaveGenerator mw;
+  mw.load_filename(palette_fn);
+
+  //An export keeps everything it renders
+  TilePyramid pyramid(dir, location, tile, sc, mw.cache(location.N), smooth, std::max(max_level, export_levels),
+		      export_levels >= 0? 0 : (size_t)budget << 20);
+  if (!pyramid.open(palette)) {
+    fprintf(stderr, "Could not use %s, which may hold tiles of another location or coloring\n", dir);
+    return 1;
+  }
+
+  if (export_levels >= 0) return render(pyramid, export_levels, nthreads);
+  return serve(pyramid, address, port, nthreads);
+}
@@ -0,0 +1,86 @@
+#include "speculate.h"
+#include "trace.h"
+#include <algorithm>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+Speculator::Speculator() : busy(false), stopping(false), generation(0) {
+  worker = std::thread(&Speculator::run, this);
+}
+
+Speculator::~Speculator() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    generation++;
+  }
+  wake.notify_all();
+  worker.join();
+}
+
+void Speculator::guess(std::vector<Guess>&& guesses) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::shared_ptr<const Guess>> kept;
+    bool keep_running = false;
+    queued.clear();
+    for (Guess& guess : guesses) {
+      ViewCache::View view(guess.deep);
+      auto it = std::find_if(finished.begin(), finished.end(), [&](const std::shared_ptr<const Guess>& g) {
+	  return ViewCache::View(g->deep) == view;
+	});
+      if (it != finished.end()) kept.push_back(*it);
+      else if (busy && running == view) keep_running = true;
+      else queued.push_back(std::move(guess));
+    }
+    finished = kept;
+    if (!keep_running) generation++;
+  }
+  wake.notify_all();
+}
+
+void Speculator::forget() {guess(std::vector<Guess>());}
+
+std::vector<std::shared_ptr<const Speculator::Guess>> Speculator::ready() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return finished;
+}
+
+void Speculator::run() {
+#ifdef __linux__
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19); //On Linux, niceness is per thread
+#endif
+
+  for (;;) {
+    Guess guess;
+    int gen;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping && queued.empty()) wake.wait(lock);
+      if (stopping) return;
+      guess = std::move(queued.front());
+      queued.erase(queued.begin());
+      running = ViewCache::View(guess.deep);
+      busy = true;
+      gen = generation;
+    }
+
+    //Both stop as soon as the guess is dropped or the speculator is destroyed
+    TraceSpan span("speculate");
+    auto wanted = [&] {return generation == gen;};
+    bool ok = guess.deep.precompute(wanted) && wanted();
+    //The coarse view holds the deep one, so its orbit serves even if it escaped before N
+    if (ok && !guess.coarse.useHardware()) {
+      ok = !guess.deep.useHardware();
+      if (ok) guess.coarse.setReference(guess.deep);
+    }
+    ok = ok && guess.coarse.computeRows(1, [&](int) {return wanted();});
+
+    std::lock_guard<std::mutex> lock(mutex);
+    busy = false;
+    if (ok && generation == gen) finished.push_back(std::make_shared<const Guess>(std::move(guess)));
+  }
+}
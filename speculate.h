@@ -0,0 +1,52 @@
+#ifndef _BPJ_NEWMAN_SPECULATE_H
+#define _BPJ_NEWMAN_SPECULATE_H
+
+#include "mandelbrot.h"
+#include "viewcache.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Views the viewer may go to next, worked on while it waits for input: one thread at the lowest
+ * scheduling priority finds each guess's reference orbit and renders a coarse grid from it, so
+ * that a render that goes there, or anywhere the orbit serves, starts with them ready. Guesses
+ * are thrown away, finished or not, as soon as new ones leave them out.
+ */
+
+class Speculator {
+public:
+  class Guess {
+  public:
+    Mandelbrot deep;   //The deepest view the guess covers, for the orbit
+    Mandelbrot coarse; //A view around it, at a few pixels per sample
+  };
+
+protected:
+  std::vector<Guess> queued;
+  std::vector<std::shared_ptr<const Guess>> finished;
+  ViewCache::View running; //The deep view of the guess being worked on
+  bool busy, stopping;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::atomic<int> generation; //Changes when the running guess is dropped, so work on it stops
+  std::thread worker;
+
+  void run();
+
+public:
+  Speculator();
+  ~Speculator();
+
+  Speculator(const Speculator&) = delete;
+  Speculator& operator=(const Speculator&) = delete;
+
+  void guess(std::vector<Guess>&& guesses); //In order of likelihood, replacing the last ones but keeping their work
+  void forget();
+  std::vector<std::shared_ptr<const Guess>> ready(); //Guesses finished so far
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include "stats.h"
+#include <algorithm>
+#include <climits>
+#include <cstdarg>
+
+void RenderStats::clear() {
+  probe_time = orbit_time = series_time = row_time = recolor_time = 0.0;
+  probes = reused_references = cached_references = 0;
+  hardware_pixels = perturbation_pixels = cardioid_pixels = mirrored_pixels = maxed_pixels = 0;
+  iterations = skipped = searches = tail_iterations = 0;
+  perturbed_iterations = detached = perturb_steps = rebases = 0;
+  skipped_min = LLONG_MAX;
+  skipped_max = 0;
+}
+
+void RenderStats::merge(const RenderStats& other) {
+  probe_time += other.probe_time;
+  orbit_time += other.orbit_time;
+  series_time += other.series_time;
+  row_time += other.row_time;
+  recolor_time += other.recolor_time;
+  probes += other.probes;
+  reused_references += other.reused_references;
+  cached_references += other.cached_references;
+  hardware_pixels += other.hardware_pixels;
+  perturbation_pixels += other.perturbation_pixels;
+  cardioid_pixels += other.cardioid_pixels;
+  mirrored_pixels += other.mirrored_pixels;
+  maxed_pixels += other.maxed_pixels;
+  iterations += other.iterations;
+  skipped += other.skipped;
+  skipped_min = std::min(skipped_min, other.skipped_min);
+  skipped_max = std::max(skipped_max, other.skipped_max);
+  searches += other.searches;
+  tail_iterations += other.tail_iterations;
+  perturbed_iterations += other.perturbed_iterations;
+  detached += other.detached;
+  perturb_steps += other.perturb_steps;
+  rebases += other.rebases;
+}
+
+void RenderStats::addSkipped(long long n) {
+  skipped += n;
+  skipped_min = std::min(skipped_min, n);
+  skipped_max = std::max(skipped_max, n);
+}
+
+static void addLine(std::vector<std::string>& lines, const char* fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  lines.push_back(buf);
+}
+
+std::vector<std::string> RenderStats::describe() const {
+  std::vector<std::string> lines;
+  addLine(lines, "Pixels: %lld (hardware %lld, perturbation %lld, cardioid %lld, mirrored %lld)",
+	  pixels(), hardware_pixels, perturbation_pixels, cardioid_pixels, mirrored_pixels);
+  addLine(lines, "Reached N: %lld", maxed_pixels);
+  addLine(lines, "Iterations: %lld (%lld iterated directly)", iterations, tail_iterations);
+  if (perturbation_pixels)
+    addLine(lines, "Skipped per pixel: min %lld, avg %.1f, max %lld",
+	    skipped_min, (double)skipped / perturbation_pixels, skipped_max);
+  addLine(lines, "Binary searches: %lld", searches);
+  if (perturbation_pixels)
+    addLine(lines, "Perturbed: %lld iterations in %lld steps (%lld rebases, %lld pixels detached)",
+	    perturbed_iterations, perturb_steps, rebases, detached);
+  if (reused_references) addLine(lines, "findProbe: reused the last reference orbit");
+  else if (cached_references) addLine(lines, "findProbe: loaded a cached reference orbit in %.3fs", probe_time);
+  else addLine(lines, "findProbe: %.3fs (%d orbits in %.3fs)", probe_time, probes, orbit_time);
+  addLine(lines, "computeSeries and BLA: %.3fs", series_time);
+  addLine(lines, "computeRow: %.3fs", row_time);
+  addLine(lines, "Recolor: %.3fs", recolor_time);
+  return lines;
+}
+
+void RenderStats::write(FILE* fp, const char* indent) const {
+  fprintf(fp, "{\n");
+  fprintf(fp, "%s  \"find_probe_s\": %.6f,\n", indent, probe_time);
+  fprintf(fp, "%s  \"compute_orbit_s\": %.6f,\n", indent, orbit_time);
+  fprintf(fp, "%s  \"compute_series_s\": %.6f,\n", indent, series_time);
+  fprintf(fp, "%s  \"compute_row_s\": %.6f,\n", indent, row_time);
+  fprintf(fp, "%s  \"recolor_s\": %.6f,\n", indent, recolor_time);
+  fprintf(fp, "%s  \"probes\": %d,\n", indent, probes);
+  fprintf(fp, "%s  \"reused_references\": %d,\n", indent, reused_references);
+  fprintf(fp, "%s  \"cached_references\": %d,\n", indent, cached_references);
+  fprintf(fp, "%s  \"pixels\": %lld,\n", indent, pixels());
+  fprintf(fp, "%s  \"hardware_pixels\": %lld,\n", indent, hardware_pixels);
+  fprintf(fp, "%s  \"perturbation_pixels\": %lld,\n", indent, perturbation_pixels);
+  fprintf(fp, "%s  \"cardioid_pixels\": %lld,\n", indent, cardioid_pixels);
+  fprintf(fp, "%s  \"mirrored_pixels\": %lld,\n", indent, mirrored_pixels);
+  fprintf(fp, "%s  \"maxed_pixels\": %lld,\n", indent, maxed_pixels);
+  fprintf(fp, "%s  \"iterations\": %lld,\n", indent, iterations);
+  fprintf(fp, "%s  \"tail_iterations\": %lld,\n", indent, tail_iterations);
+  fprintf(fp, "%s  \"skipped\": %lld,\n", indent, skipped);
+  fprintf(fp, "%s  \"skipped_min\": %lld,\n", indent, perturbation_pixels? skipped_min : 0);
+  fprintf(fp, "%s  \"skipped_avg\": %.3f,\n", indent, perturbation_pixels? (double)skipped / perturbation_pixels : 0.0);
+  fprintf(fp, "%s  \"skipped_max\": %lld,\n", indent, skipped_max);
+  fprintf(fp, "%s  \"searches\": %lld,\n", indent, searches);
+  fprintf(fp, "%s  \"perturbed_iterations\": %lld,\n", indent, perturbed_iterations);
+  fprintf(fp, "%s  \"perturb_steps\": %lld,\n", indent, perturb_steps);
+  fprintf(fp, "%s  \"rebases\": %lld,\n", indent, rebases);
+  fprintf(fp, "%s  \"detached\": %lld\n", indent, detached);
+  fprintf(fp, "%s}", indent);
+}
+
+bool RenderStats::save(const char* fn) const {
+  FILE* fp = fopen(fn, "w");
+  if (!fp) return false;
+  write(fp);
+  fprintf(fp, "\n");
+  fclose(fp);
+  return true;
+}
@@ -0,0 +1,49 @@
+#ifndef _BPJ_NEWMAN_STATS_H
+#define _BPJ_NEWMAN_STATS_H
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+inline double secondsSince(Clock::time_point t) {
+  return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+//Counters for a single render; each thread keeps its own and they are merged afterward
+class RenderStats {
+public:
+  //Seconds. Orbits are computed within findProbe; rows are summed over threads.
+  double probe_time, orbit_time, series_time, row_time, recolor_time;
+  int probes;
+  int reused_references; //precompute kept the last view's reference orbit
+  int cached_references; //precompute loaded it from the reference cache
+
+  long long hardware_pixels, perturbation_pixels, cardioid_pixels;
+  long long mirrored_pixels; //Copied from their conjugates across the real axis
+  long long maxed_pixels; //Reached N
+  long long iterations;   //Up to escape or N, over every pixel
+  long long skipped, skipped_min, skipped_max; //By the series, per perturbation pixel
+  long long searches;     //Escaped within the series, so found by binary search
+  long long tail_iterations; //Iterated directly, in hardware or high precision
+  long long perturbed_iterations; //Iterated as double deltas from the reference
+  long long detached;     //Pixels the deltas couldn't finish, continued in high precision
+  long long perturb_steps; //Taken by the kernel over those iterations; bilinear steps cover many
+  long long rebases;      //Pixels moved back to the start of the reference orbit
+
+  RenderStats() {clear();}
+
+  void clear();
+  void merge(const RenderStats& other);
+
+  long long pixels() const {return hardware_pixels + perturbation_pixels + cardioid_pixels + mirrored_pixels;}
+  void addSkipped(long long n);
+
+  std::vector<std::string> describe() const; //Lines for display
+  void write(FILE* fp, const char* indent = "") const; //As a JSON object
+  bool save(const char* fn) const;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "tiles.h"
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+constexpr char job_magic[] = "newman-tiles 3";
+
+TileJob::TileJob() : N(0), power(2), nr(0), nc(0), tile(1), error_tolerance(1e-10), series_order(3) { }
+
+TileJob::TileJob(const Mandelbrot& view, int tile) {
+  N = view.N;
+  power = view.power;
+  nr = view.rows();
+  nc = view.cols();
+  this->tile = tile;
+  error_tolerance = view.error_tolerance;
+  series_order = view.series_order;
+  
+  sz.re = view.sz.re;
+  sz.im = view.sz.im;
+  center.re.set_prec(view.center.re.get_prec());
+  center.im.set_prec(view.center.im.get_prec());
+  center.re = view.center.re;
+  center.im = view.center.im;
+}
+
+void TileJob::bounds(int i, int& r0, int& c0, int& tr, int& tc) const {
+  r0 = (i / tilesAcross()) * tile;
+  c0 = (i % tilesAcross()) * tile;
+  tr = std::min(tile, nr - r0);
+  tc = std::min(tile, nc - c0);
+}
+
+Mandelbrot TileJob::engine(int i) const {
+  int r0, c0, tr, tc;
+  bounds(i, r0, c0, tr, tc);
+
+  Mandelbrot mandel(tr, tc);
+  mandel.N = N;
+  mandel.power = power;
+  mandel.error_tolerance = error_tolerance;
+  mandel.series_order = series_order;
+
+  mandel.setView(center, sz);
+  HPComplex pt(mandel.precision()); //After setView, which sets it
+  pt.re = center.re + (c0 + tc / 2 - nc / 2) * sz.re;
+  pt.im = center.im + (nr / 2 - r0 - tr / 2) * sz.im;
+  mandel.center.re = pt.re;
+  mandel.center.im = pt.im;
+  
+  return mandel;
+}
+
+Mandelbrot TileJob::view() const {
+  Mandelbrot mandel(nr, nc);
+  mandel.N = N;
+  mandel.power = power;
+  mandel.error_tolerance = error_tolerance;
+  mandel.series_order = series_order;
+  mandel.setView(center, sz);
+  return mandel;
+}
+
+bool TileJob::save(const char* fn) const {
+  FILE* fp = fopen(fn, "w");
+  if (!fp) return false;
+
+  fprintf(fp, "%s\n%d %d %d %d %d %.17g %d\n", job_magic, N, power, nr, nc, tile, error_tolerance, series_order);
+  for (const mpf_class* v : {&sz.re, &sz.im, &center.re, &center.im}) {
+    writeHex(fp, *v);
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  return true;
+}
+
+bool TileJob::load(const char* fn) {
+  FILE* fp = fopen(fn, "r");
+  if (!fp) return false;
+
+  char buf[4096];
+  bool ok = (fgets(buf, sizeof(buf), fp) && !strncmp(buf, job_magic, strlen(job_magic))
+	     && fscanf(fp, "%d %d %d %d %d %lf %d", &N, &power, &nr, &nc, &tile, &error_tolerance, &series_order) == 7
+	     && fscanf(fp, "%4095s", buf) == 1 && readHex(sz.re, buf)
+	     && fscanf(fp, "%4095s", buf) == 1 && readHex(sz.im, buf));
+
+  //Precision follows from the pixel size, as in Mandelbrot::setPrecision
+  if (ok) {
+    signed long int e;
+    mpf_get_d_2exp(&e, sz.re.get_mpf_t());
+    int bits = std::max(64, (int)(64 - e + log2(1.0e-20)));
+    center.re.set_prec(bits);
+    center.im.set_prec(bits);
+    ok = (fscanf(fp, "%4095s", buf) == 1 && !center.re.set_str(buf, -16)
+	  && fscanf(fp, "%4095s", buf) == 1 && !center.im.set_str(buf, -16));
+  }
+  fclose(fp);
+  return (ok && tile > 0 && power >= 2 && power <= max_power
+	  && series_order >= 2 && series_order <= max_series_order);
+}
+
+TileQueue::TileQueue(const std::string& dir) : dir(dir) {
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host) - 1);
+  id = std::string(host) + "-" + std::to_string(getpid());
+}
+
+std::string TileQueue::path(int i, const std::string& ext) const {
+  char buf[32];
+  sprintf(buf, "/tile-%06d.", i);
+  return dir + buf + ext;
+}
+
+std::string TileQueue::jobPath() const {return dir + "/job.txt";}
+std::string TileQueue::referencePath() const {return dir + "/reference.txt";}
+std::string TileQueue::gridPath(int i) const {return path(i, "grid");}
+
+bool TileQueue::create(const TileJob& job, const Mandelbrot* reference) {
+  mkdir(dir.c_str(), 0777);
+  unlink((dir + "/done").c_str());
+  unlink(jobPath().c_str());
+  unlink(referencePath().c_str());
+  if (DIR* d = opendir(dir.c_str())) {
+    while (struct dirent* entry = readdir(d))
+      if (!strncmp(entry->d_name, "tile-", 5))
+	unlink((dir + "/" + entry->d_name).c_str());
+    closedir(d);
+  }
+
+  //The job description goes last so workers never see a partial queue
+  if (reference && !reference->saveReference(referencePath().c_str())) return false;
+  for (int i = 0; i < job.count(); i++) {
+    FILE* fp = fopen(path(i, "todo").c_str(), "w");
+    if (!fp) return false;
+    fclose(fp);
+  }
+  
+  std::string tmp = jobPath() + ".tmp";
+  return job.save(tmp.c_str()) && !rename(tmp.c_str(), jobPath().c_str());
+}
+
+int TileQueue::requeueStale(double timeout) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return 0;
+
+  int count = 0, i;
+  struct stat st;
+  std::string fn;
+  time_t now = time(NULL);
+  while (struct dirent* entry = readdir(d)) {
+    if (sscanf(entry->d_name, "tile-%d.work-", &i) != 1 || !strstr(entry->d_name, ".work-")) continue;
+    fn = dir + "/" + entry->d_name;
+    if (!stat(fn.c_str(), &st) && difftime(now, st.st_mtime) > timeout
+	&& !rename(fn.c_str(), path(i, "todo").c_str()))
+      count++;
+  }
+  closedir(d);
+  return count;
+}
+
+bool TileQueue::isDone(int i) const {return !access(gridPath(i).c_str(), F_OK);}
+
+void TileQueue::markDone() {
+  FILE* fp = fopen((dir + "/done").c_str(), "w");
+  if (fp) fclose(fp);
+}
+
+bool TileQueue::finished() const {return !access((dir + "/done").c_str(), F_OK);}
+
+bool TileQueue::claim(int& i) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return false;
+
+  bool claimed = false;
+  while (struct dirent* entry = readdir(d)) {
+    if (sscanf(entry->d_name, "tile-%d.todo", &i) != 1 || !strstr(entry->d_name, ".todo")) continue;
+    if (!rename(path(i, "todo").c_str(), path(i, "work-" + id).c_str())) {
+      claimed = true;
+      break;
+    }
+  }
+  closedir(d);
+  return claimed;
+}
+
+void TileQueue::heartbeat(int i) {utime(path(i, "work-" + id).c_str(), NULL);}
+
+bool TileQueue::submit(int i, const Mandelbrot& tile) {
+  std::string tmp = path(i, "tmp-" + id);
+  bool ok = tile.saveEscapes(tmp.c_str()) && !rename(tmp.c_str(), gridPath(i).c_str());
+  unlink(path(i, "work-" + id).c_str());
+  return ok;
+}
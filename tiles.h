@@ -0,0 +1,67 @@
+#ifndef _BPJ_NEWMAN_TILES_H
+#define _BPJ_NEWMAN_TILES_H
+
+#include "mandelbrot.h"
+#include <string>
+
+/*
+ * A view split into square tiles of samples. Each tile is rendered by its own
+ * engine, whose center is shifted so that its grid lines up exactly with the
+ * matching block of the full view's grid.
+ */
+
+class TileJob {
+public:
+  int N, power, nr, nc, tile;
+  double error_tolerance;
+  int series_order;
+  HPComplex center, sz;
+
+  TileJob();
+  TileJob(const Mandelbrot& view, int tile);
+
+  inline int tilesDown() const {return (nr + tile - 1) / tile;}
+  inline int tilesAcross() const {return (nc + tile - 1) / tile;}
+  inline int count() const {return tilesDown() * tilesAcross();}
+  
+  void bounds(int i, int& r0, int& c0, int& tr, int& tc) const;
+  Mandelbrot engine(int i) const;
+  Mandelbrot view() const; //The whole view, in one engine
+
+  bool save(const char* fn) const;
+  bool load(const char* fn);
+};
+
+/*
+ * Shared-directory transport. Tiles move from .todo to .work (claimed by an
+ * atomic rename) to .grid. Workers touch their .work file as a heartbeat, and
+ * the coordinator puts stale ones back in the queue.
+ */
+
+class TileQueue {
+protected:
+  std::string dir, id;
+
+  std::string path(int i, const std::string& ext) const;
+  
+public:
+  TileQueue(const std::string& dir);
+
+  std::string jobPath() const;
+  std::string referencePath() const;
+  std::string gridPath(int i) const;
+
+  //Coordinator
+  bool create(const TileJob& job, const Mandelbrot* reference);
+  int requeueStale(double timeout); //Returns the number of tiles requeued
+  bool isDone(int i) const;
+  void markDone();
+
+  //Worker
+  bool finished() const;
+  bool claim(int& i);
+  void heartbeat(int i);
+  bool submit(int i, const Mandelbrot& tile);
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "trace.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class TraceEvent {
+public:
+  const char *name, *arg_name;
+  long arg;
+  Clock::time_point t0, t1;
+};
+
+class TraceBuffer {
+public:
+  int tid;
+  std::mutex mutex; //Only ever contended by start and stop
+  std::vector<TraceEvent> events;
+};
+
+//Buffers outlive their threads, so short-lived workers can still be written out
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static thread_local TraceBuffer* local = nullptr;
+static Clock::time_point epoch;
+
+std::atomic<bool> Trace::on(false);
+
+void Trace::start() {
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  for (auto& buffer : buffers) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    buffer->events.clear();
+  }
+  epoch = Clock::now();
+  on = true;
+}
+
+void Trace::record(const char* name, const char* arg_name, long arg, Clock::time_point t0) {
+  if (!local) {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers.emplace_back(new TraceBuffer);
+    local = buffers.back().get();
+    local->tid = buffers.size();
+  }
+
+  TraceEvent event;
+  event.name = name;
+  event.arg_name = arg_name;
+  event.arg = arg;
+  event.t0 = t0;
+  event.t1 = Clock::now();
+  std::lock_guard<std::mutex> lock(local->mutex);
+  local->events.push_back(event);
+}
+
+static double microseconds(Clock::time_point t) {
+  return std::chrono::duration<double, std::micro>(t - epoch).count();
+}
+
+bool Trace::stop(const char* fn) {
+  on = false;
+
+  FILE* fp = fopen(fn, "w");
+  if (!fp) return false;
+
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+  const char* sep = "\n";
+  fprintf(fp, "{\"traceEvents\": [");
+  for (auto& buffer : buffers) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    if (buffer->events.empty()) continue;
+    fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"Thread %d\"}}",
+	    sep, buffer->tid, buffer->tid);
+    sep = ",\n";
+
+    for (auto& event : buffer->events) {
+      fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+	      sep, event.name, buffer->tid, microseconds(event.t0), microseconds(event.t1) - microseconds(event.t0));
+      if (event.arg_name) fprintf(fp, ", \"args\": {\"%s\": %ld}", event.arg_name, event.arg);
+      fprintf(fp, "}");
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  return true;
+}
@@ -0,0 +1,40 @@
+#ifndef _BPJ_NEWMAN_TRACE_H
+#define _BPJ_NEWMAN_TRACE_H
+
+#include "stats.h"
+#include <atomic>
+
+/*
+ * Timeline of spans for chrome://tracing or Perfetto. Each thread records into its own
+ * buffer; when tracing is off, a span costs one relaxed load.
+ */
+
+class Trace {
+protected:
+  static std::atomic<bool> on;
+
+public:
+  static inline bool enabled() {return on.load(std::memory_order_relaxed);}
+  static void start();              //Discards anything recorded before; call between renders
+  static bool stop(const char* fn); //Writes trace-event JSON
+
+  static void record(const char* name, const char* arg_name, long arg, Clock::time_point t0);
+};
+
+//Records the time from construction to destruction; names must be string literals
+class TraceSpan {
+protected:
+  const char *name, *arg_name;
+  long arg;
+  bool active;
+  Clock::time_point t0;
+
+public:
+  TraceSpan(const char* name, const char* arg_name = nullptr, long arg = 0)
+    : name(name), arg_name(arg_name), arg(arg), active(Trace::enabled()) {
+    if (active) t0 = Clock::now();
+  }
+  ~TraceSpan() {if (active) Trace::record(name, arg_name, arg, t0);}
+};
+
+#endif
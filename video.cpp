@@ -1,7 +1,8 @@
 #include "video.h"
+#include "trace.h"
 
 VideoZoom::VideoZoom()
-  : nr(0), nc(0), rate(30) { }
+  : nr(0), nc(0), rate(30), next(0) { }
 
 void VideoZoom::start(const std::string& name, int nr, int nc, int rate) {
   writer.open(name, nr, nc, 30);
@@ -9,9 +10,12 @@ void VideoZoom::start(const std::string& name, int nr, int nc, int rate) {
   this->nr = nr;
   this->nc = nc;
   this->rate = rate;
+  queued.clear();
+  next = 0;
 }
 
 void VideoZoom::nextFrame(const ByteImage& img) {
+  TraceSpan span("nextFrame");
   if (this->img.size()) {
     ByteImage canvas(nr, nc, 3), small, large;
     float t, v = pow(1.5, 1.0 / rate), sm = 2.0 / 3.0, lg = 1.0;
@@ -32,3 +36,32 @@ void VideoZoom::nextFrame(const ByteImage& img) {
 
   this->img = img;
 }
+
+void VideoZoom::write(const ByteImage& frame) {writer.write(frame);}
+
+void VideoZoom::submit(int index, ByteImage img) {
+  std::lock_guard<std::mutex> lock(mutex);
+  queued[index] = std::move(img);
+}
+
+bool VideoZoom::flush(ByteImage& last) {
+  std::map<int, ByteImage>::iterator it;
+  bool wrote = false;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      it = queued.find(next);
+      if (it == queued.end()) return wrote;
+      last = std::move(it->second);
+      queued.erase(it);
+      next++;
+    }
+    nextFrame(last);
+    wrote = true;
+  }
+}
+
+int VideoZoom::pending() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return queued.size();
+}
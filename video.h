@@ -2,6 +2,8 @@
 #define _BPJ_NEWMAN_VIDEO_H
 
 #include <byteimage/video.h>
+#include <map>
+#include <mutex>
 
 using byteimage::ByteImage;
 using byteimage::VideoWriter;
@@ -16,12 +18,22 @@ protected:
   ByteImage img;
   int nr, nc;
   int rate;//Frames to interpolate per zoom
+
+  //Reorder buffer for keyframes rendered out of order
+  std::mutex mutex;
+  std::map<int, ByteImage> queued;
+  int next;
   
 public:
   VideoZoom();
   
   void start(const std::string& name, int nr, int nc, int rate);
   void nextFrame(const ByteImage& img);
+
+  void submit(int index, ByteImage img); //Thread-safe
+  bool flush(ByteImage& last);           //Passes queued keyframes to nextFrame in order
+  int pending();
+  void write(const ByteImage& frame); //Writes a finished frame as-is
 };
 
 #endif
@@ -0,0 +1,221 @@
+#include "viewcache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char view_magic[] = "newman-view 1";
+
+static void copyValue(mpf_class& to, const mpf_class& from) {
+  to.set_prec(from.get_prec());
+  to = from;
+}
+
+ViewCache::View::View(const Mandelbrot& mandel)
+  : center(mandel.center), sz(mandel.sz), N(mandel.N), power(mandel.power), nr(mandel.rows()), nc(mandel.cols()),
+    series_order(mandel.series_order), error_tolerance(mandel.error_tolerance) { }
+
+ViewCache::View& ViewCache::View::operator=(const View& other) {
+  copyValue(center.re, other.center.re);
+  copyValue(center.im, other.center.im);
+  copyValue(sz.re, other.sz.re);
+  copyValue(sz.im, other.sz.im);
+  N = other.N;
+  power = other.power;
+  nr = other.nr;
+  nc = other.nc;
+  series_order = other.series_order;
+  error_tolerance = other.error_tolerance;
+  return *this;
+}
+
+bool ViewCache::View::sameScale(const View& other) const {
+  return (N == other.N && power == other.power && nr == other.nr && nc == other.nc
+	  && series_order == other.series_order && error_tolerance == other.error_tolerance
+	  && !cmp(sz.re, other.sz.re) && !cmp(sz.im, other.sz.im));
+}
+
+bool ViewCache::View::operator==(const View& other) const {
+  return sameScale(other) && !cmp(center.re, other.center.re) && !cmp(center.im, other.center.im);
+}
+
+//Whole samples, or near enough that no sample moves by more than rounding in the center
+static bool wholeSteps(const mpf_class& a, const mpf_class& b, const mpf_class& step, int& steps) {
+  mpf_class d(0, std::max(a.get_prec(), b.get_prec()));
+  d = a - b;
+  d /= step;
+  double x = d.get_d();
+  if (!(std::abs(x) < 1.0e6)) return false;
+  steps = (int)std::lround(x);
+  return std::abs(x - steps) < 1.0e-6;
+}
+
+bool ViewCache::View::offset(const View& other, int& dr, int& dc) const {
+  //Rows count down from the top, so they run against the imaginary axis
+  return (sameScale(other) && wholeSteps(center.re, other.center.re, sz.re, dc)
+	  && wholeSteps(other.center.im, center.im, sz.im, dr));
+}
+
+static bool readView(FILE* fp, ViewCache::View& view) {
+  char buf[4096];
+  return (fgets(buf, sizeof(buf), fp) && !strncmp(buf, view_magic, strlen(view_magic))
+	  && fscanf(fp, "%d %d %d %d %d %lf", &view.N, &view.power, &view.nr, &view.nc, &view.series_order,
+		    &view.error_tolerance) == 6
+	  && fscanf(fp, "%4095s", buf) == 1 && readHex(view.sz.re, buf)
+	  && fscanf(fp, "%4095s", buf) == 1 && readHex(view.sz.im, buf)
+	  && fscanf(fp, "%4095s", buf) == 1 && readHex(view.center.re, buf)
+	  && fscanf(fp, "%4095s", buf) == 1 && readHex(view.center.im, buf)
+	  && fgetc(fp) == '\n' && view.nr > 0 && view.nc > 0);
+}
+
+ViewCache::ViewCache(const std::string& dir, size_t memory_budget, size_t disk_budget)
+  : dir(dir), memory_budget(memory_budget), disk_budget(disk_budget) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+
+  //Views from earlier sessions, newest first by when they were written
+  std::vector<std::pair<time_t, Entry>> found;
+  while (struct dirent* e = readdir(d)) {
+    if (strncmp(e->d_name, "view-", 5)) continue;
+    Entry entry;
+    entry.file = e->d_name;
+    std::string path = dir + "/" + entry.file;
+    struct stat st;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) continue;
+    bool ok = readView(fp, entry.view) && !fstat(fileno(fp), &st);
+    fclose(fp);
+    if (!ok) continue;
+    entry.bytes = st.st_size;
+    found.push_back(std::make_pair(st.st_mtime, entry));
+  }
+  closedir(d);
+
+  std::stable_sort(found.begin(), found.end(), [](const std::pair<time_t, Entry>& a, const std::pair<time_t, Entry>& b) {
+      return a.first > b.first;
+    });
+  for (auto& f : found) entries.push_back(f.second);
+  trim();
+}
+
+ViewCache::~ViewCache() {
+  for (Entry& entry : entries)
+    if (entry.grid && entry.file.empty()) write(entry);
+  trim();
+}
+
+bool ViewCache::write(Entry& entry) {
+  mkdir(dir.c_str(), 0777);
+
+  static int counter = 0;
+  char name[64];
+  sprintf(name, "view-%d-%d-%d.dat", (int)time(NULL), (int)getpid(), counter++);
+  std::string path = dir + "/" + name, tmp = path + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp) return false;
+
+  const View& v = entry.view;
+  fprintf(fp, "%s\n%d %d %d %d %d %.17g\n", view_magic, v.N, v.power, v.nr, v.nc, v.series_order, v.error_tolerance);
+  for (const mpf_class* x : {&v.sz.re, &v.sz.im, &v.center.re, &v.center.im}) {
+    writeHex(fp, *x);
+    fprintf(fp, "\n");
+  }
+  const std::vector<RenderGrid::EscapeValue>& values = entry.grid->values;
+  bool ok = fwrite(values.data(), sizeof(RenderGrid::EscapeValue), values.size(), fp) == values.size();
+  ok = !fclose(fp) && ok && !rename(tmp.c_str(), path.c_str());
+  if (!ok) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  entry.file = name;
+  return true;
+}
+
+std::shared_ptr<const RenderGrid> ViewCache::read(const Entry& entry) const {
+  if (entry.grid) return entry.grid;
+  if (entry.file.empty()) return nullptr;
+
+  FILE* fp = fopen((dir + "/" + entry.file).c_str(), "rb");
+  if (!fp) return nullptr;
+  View view;
+  std::shared_ptr<RenderGrid> grid;
+  if (readView(fp, view) && view == entry.view) {
+    grid = std::make_shared<RenderGrid>(view.nr, view.nc);
+    if (fread(grid->values.data(), sizeof(RenderGrid::EscapeValue), grid->values.size(), fp) != grid->values.size())
+      grid = nullptr;
+  }
+  fclose(fp);
+  return grid;
+}
+
+//Oldest first: out of memory onto disk, then off disk altogether
+void ViewCache::trim() {
+  size_t memory = 0, disk = 0;
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->grid && (memory += it->bytes) > memory_budget) {
+      if (it->file.empty()) write(*it);
+      it->grid = nullptr;
+    }
+    if (!it->file.empty() && (disk += it->bytes) > disk_budget) {
+      unlink((dir + "/" + it->file).c_str());
+      it->file.clear();
+    }
+    if (!it->grid && it->file.empty()) it = entries.erase(it);
+    else ++it;
+  }
+}
+
+void ViewCache::store(const Mandelbrot& mandel) {
+  View view(mandel);
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+    if (it->view == view) {
+      if (!it->file.empty()) unlink((dir + "/" + it->file).c_str());
+      entries.erase(it);
+      break;
+    }
+
+  Entry entry;
+  entry.view = view;
+  entry.grid = std::make_shared<RenderGrid>(mandel.escapes());
+  entry.bytes = entry.grid->values.size() * sizeof(RenderGrid::EscapeValue);
+  entries.push_front(entry);
+  trim();
+}
+
+bool ViewCache::restore(Mandelbrot& mandel, int& r0, int& c0, int& r1, int& c1) {
+  View view(mandel);
+  std::list<Entry>::iterator best = entries.end();
+  int best_area = 0, best_dr = 0, best_dc = 0, dr, dc;
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    if (!view.offset(it->view, dr, dc)) continue;
+    int area = std::max(0, view.nr - std::abs(dr)) * std::max(0, view.nc - std::abs(dc));
+    if (area > best_area) {
+      best = it;
+      best_area = area;
+      best_dr = dr;
+      best_dc = dc;
+      if (!dr && !dc) break;
+    }
+  }
+  if (best == entries.end()) return false;
+
+  std::shared_ptr<const RenderGrid> grid = read(*best);
+  if (!grid) {
+    entries.erase(best);
+    return false;
+  }
+  mandel.paste(*grid, best_dr, best_dc);
+  r0 = std::max(0, -best_dr);
+  r1 = std::min(view.nr, view.nr - best_dr);
+  c0 = std::max(0, -best_dc);
+  c1 = std::min(view.nc, view.nc - best_dc);
+
+  //Back to the front, in memory again
+  best->grid = grid;
+  entries.splice(entries.begin(), entries, best);
+  trim();
+  return true;
+}
@@ -0,0 +1,70 @@
+#ifndef _BPJ_NEWMAN_VIEWCACHE_H
+#define _BPJ_NEWMAN_VIEWCACHE_H
+
+#include "mandelbrot.h"
+#include <list>
+#include <memory>
+#include <string>
+
+/*
+ * Grids of views rendered before, so going back to one shows it at once and panning keeps the
+ * samples the old and new views share. The newest are kept in memory; past the memory budget
+ * the oldest are written to the directory and dropped, and past the disk budget their files
+ * are deleted too. What is still only in memory is written out on destruction, so a later
+ * session finds it.
+ */
+
+class ViewCache {
+public:
+  //Everything a grid depends on
+  class View {
+  public:
+    HPComplex center, sz;
+    int N, power, nr, nc, series_order;
+    double error_tolerance;
+
+    View() : N(0), power(0), nr(0), nc(0), series_order(0), error_tolerance(0.0) { }
+    View(const Mandelbrot& mandel);
+    View(const View&) = default;
+    View& operator=(const View& other); //Taking other's precision, which mpf_class assignment doesn't
+
+    bool sameScale(const View& other) const; //All but the center
+    bool operator==(const View& other) const;
+
+    //Whether other's samples line up with ours, where sample (r, c) of ours is (r + dr, c + dc) of other's
+    bool offset(const View& other, int& dr, int& dc) const;
+  };
+
+protected:
+  class Entry {
+  public:
+    View view;
+    std::shared_ptr<const RenderGrid> grid; //Null once only on disk
+    std::string file;                       //Empty until written
+    size_t bytes;
+  };
+
+  std::string dir;
+  size_t memory_budget, disk_budget;
+  std::list<Entry> entries; //Most recently used first
+
+  bool write(Entry& entry);
+  std::shared_ptr<const RenderGrid> read(const Entry& entry) const;
+  void trim();
+
+public:
+  ViewCache(const std::string& dir, size_t memory_budget, size_t disk_budget);
+  ~ViewCache();
+
+  ViewCache(const ViewCache&) = delete;
+  ViewCache& operator=(const ViewCache&) = delete;
+
+  void store(const Mandelbrot& mandel);
+
+  //Fills in what the cache has of mandel's view: all of it for a view seen before, or else the
+  //most of any at the same scale that lines up, as rows r0 to r1 - 1 and columns c0 to c1 - 1.
+  //Returns false if there is nothing.
+  bool restore(Mandelbrot& mandel, int& r0, int& c0, int& r1, int& c1);
+};
+
+#endif
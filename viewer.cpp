@@ -1,14 +1,35 @@
 #include "viewer.h"
 #include "display.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include <atomic>
+#include <thread>
 
 using namespace byteimage;
 
+const int auto_max_N = 1 << 20; //For automatic iterations
+const char* reference_cache_dir = "references";
+const char* view_cache_dir = "views";
+const size_t view_memory = (size_t)256 << 20, view_disk = (size_t)1 << 30; //Bytes
+const int max_history = 256;
+enum {batch_priority, video_priority, beauty_priority};
+
+//Kept from the job queue, for exploring while it runs
+static int interactiveThreads() {return std::max(1, (int)std::thread::hardware_concurrency() / 4);}
+
 void FractalViewer::save() {
   MyDisplay* display = (MyDisplay*)this->display;
   
   std::string fn;
   if (!display->getString("Enter a filename to save:", fn)) return;
 
+  //The legacy format has no room for the formula, and is read back at 800x600
+  if (mandel.power != 2 || img.nr != 600 || img.nc != 800) {
+    if (mandel.save(fn.c_str())) display->print("Saved to " + fn);
+    else display->print("Could not save to " + fn);
+    return;
+  }
+
   FILE* fp = fopen(fn.c_str(), "w");
   if (fp) {
     fprintf(fp, "%d\n", mandel.N);
@@ -37,7 +58,7 @@ void FractalViewer::load() {
   FILE* fp = fopen(fn.c_str(), "r");
   if (fp) {
     fclose(fp);
-    mandel.loadLegacy(fn.c_str());
+    if (!mandel.load(fn.c_str())) mandel.loadLegacy(fn.c_str());
 
     updatePalette();
       
@@ -55,8 +76,13 @@ void FractalViewer::screenshot() {
   char fn[256];
   int t = (int)time(NULL);
   sprintf(fn, "%d.png", t);
-  img.save_filename(fn);
-  display->print(OSD_Printer::string("Saved screenshot to %s", fn));
+  {
+    TraceSpan span("savePNG");
+    img.save_filename(fn);
+  }
+  sprintf(fn, "%d.json", t);
+  mandel.stats.save(fn);
+  display->print(OSD_Printer::string("Saved screenshot to %d.png", t));
 }
 
 void FractalViewer::constructDefaultPalette() {
@@ -69,11 +95,12 @@ void FractalViewer::updatePalette() {
 }
 
 void FractalViewer::reset() {
-  renderflag = drawlines = smoothflag = true;
-  zoomflag = false;
+  renderflag = drawlines = smoothflag = dynamicflag = true;
+  statsflag = autoflag = false;
   mousedown = 0;
 
   mandel = Mandelbrot(img.nr, img.nc);
+  mandel.reference_cache = reference_cache_dir;
   sc = 1;
   
   constructDefaultPalette();
@@ -82,181 +109,535 @@ void FractalViewer::reset() {
 }
   
 void FractalViewer::recolor() {
+  TraceSpan span("recolor");
   for (int r = 0; r < img.nr; r++)
     colorLine(r);
 }
 
 Color FractalViewer::getColor(const RenderGrid::EscapeValue& escape) {
-  if (escape.iterations >= mandel.N) return Color(0);
-  else if (!smoothflag) return pal[escape.iterations];
-  else return interp(pal[escape.iterations - 1],
-		     pal[escape.iterations],
-		     escape.smoothing);
+  return ::getColor(pal, smoothflag, mandel.N, escape);
 }
 
 void FractalViewer::colorLine(int r) {
-  Color color;
+  Clock::time_point t = Clock::now();
+  ::colorLine(pal, smoothflag, mandel, sc, img, r);
+  mandel.stats.recolor_time += secondsSince(t);
+}
 
-  if (sc == 1) {
-    for (int c = 0; c < img.nc; c++) {
-      color = getColor(mandel.at(r, c));
-      
-      img.at(r, c, 0) = color.r;
-      img.at(r, c, 1) = color.g;
-      img.at(r, c, 2) = color.b;
-    }
-  }
-  else {
-    Pt3f rgb;
-    for (int c = 0; c < img.nc; c++) {
-      rgb = Pt3f();
-      for (int r1 = r * sc; r1 < (r + 1) * sc; r1++)
-	for (int c1 = c * sc; c1 < (c + 1) * sc; c1++) {
-	  color = getColor(mandel.at(r1, c1));
-	  rgb.x += color.r; rgb.y += color.g; rgb.z += color.b;
-	}
-      rgb = rgb / (sc * sc);
-      img.at(r, c, 0) = clip(rgb.x);
-      img.at(r, c, 1) = clip(rgb.y);
-      img.at(r, c, 2) = clip(rgb.z);
+//Input that should stop a render is left queued for the event loop
+bool FractalViewer::interrupted() {
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    if (event.type == SDL_MOUSEBUTTONDOWN
+	|| (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
+	|| (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE)
+	|| event.type == SDL_QUIT) {
+      SDL_PushEvent(&event);
+      return true;
     }
   }
+  return false;
 }
 
 bool FractalViewer::drawLine(int r) {
   MyDisplay* display = (MyDisplay*)this->display;
   
   colorLine(r);
+  if (interrupted()) return true;
 
-  SDL_Event event;
-  while (SDL_PollEvent(&event)) {
-    if (zoomflag) {
-      if ((event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
-	  || (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE)
-	  || event.type == SDL_QUIT) {
-	SDL_PushEvent(&event);
-	zoomflag = false;
-	return true;
-      }
+  display->setRenderFlag();
+  return display->forceUpdate();
+}
+
+//Pixels per side of each preview sample: the smallest power of two whose preview fits the frame
+//budget at the last render's speed, or 1 if the render itself would
+int FractalViewer::previewFactor() const {
+  const int max_factor = 16;
+  if (!dynamicflag || !drawlines || sample_time <= 0.0
+      || (double)mandel.rows() * mandel.cols() * sample_time <= frame_budget)
+    return 1;
+
+  int f = 2;
+  while (f < max_factor && (double)(img.nr / f) * (img.nc / f) * sample_time / interactiveThreads() > frame_budget)
+    f *= 2;
+  return f;
+}
+
+Mandelbrot FractalViewer::engine(int nr, int nc) const {
+  Mandelbrot m(nr, nc);
+  m.N = mandel.N;
+  m.power = mandel.power;
+  m.error_tolerance = mandel.error_tolerance;
+  m.series_order = mandel.series_order;
+  m.forced_arithmetic = mandel.forced_arithmetic;
+  m.reference_cache = mandel.reference_cache;
+  return m;
+}
+
+//mandel's orbit, or else a guessed one. False if none serves the engine's view.
+bool FractalViewer::shareReference(Mandelbrot& engine) {
+  if (engine.useHardware()) return true;
+  if (engine.canShare(mandel)) {
+    engine.setReference(mandel);
+    return true;
+  }
+  for (auto& guess : speculator.ready())
+    if (engine.canShare(guess->deep)) {
+      engine.setReference(guess->deep);
+      return true;
     }
-    else {
-      if (event.type == SDL_MOUSEBUTTONDOWN
-	  || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
-	  || (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE)
-	  || event.type == SDL_QUIT) {
-	SDL_PushEvent(&event);
-	return true;
+  return false;
+}
+
+//An engine with one sample per f x f block of pixels, each in the middle of its block, for a view
+//given as mandel's would be. It shares an orbit already found, so false if none can serve it.
+bool FractalViewer::setupPreview(Mandelbrot& preview, const HPComplex& center, const HPComplex& sz, int f) {
+  preview = engine(std::max(img.nr / f, 1), std::max(img.nc / f, 1));
+  HPComplex preview_center(center.re.get_prec()), preview_sz(sz.re.get_prec());
+  preview_sz.re = sz.re * (f * sc);
+  preview_sz.im = sz.im * (f * sc);
+  preview_center.re = center.re + ((f - 1) * sc / 2.0) * sz.re;
+  preview_center.im = center.im + ((f - 1) * sc / 2.0) * sz.im;
+  preview.setView(preview_center, preview_sz);
+  return shareReference(preview);
+}
+
+void FractalViewer::drawPreview(const Mandelbrot& preview, int f, ByteImage& out) {
+  if (out.nr != img.nr || out.nc != img.nc) out = ByteImage(img.nr, img.nc, 3);
+  Color color;
+  for (int r = 0; r < out.nr; r++)
+    for (int c = 0; c < out.nc; c++) {
+      color = getColor(preview.at(std::min(r / f, preview.rows() - 1), std::min(c / f, preview.cols() - 1)));
+      out.at(r, c, 0) = color.r;
+      out.at(r, c, 1) = color.g;
+      out.at(r, c, 2) = color.b;
+    }
+}
+
+//Renders one sample per f x f block of pixels and shows it. Returns true if interrupted.
+bool FractalViewer::renderPreview(int f) {
+  Mandelbrot preview;
+  if (!setupPreview(preview, mandel.center, mandel.sz, f) && !preview.useHardware())
+    preview.setReference(mandel); //Its own orbit, even one that escaped early
+
+  Uint32 t = SDL_GetTicks();
+  bool stopped = !preview.computeRows(interactiveThreads(), [&](int) {
+      if (SDL_GetTicks() - t < 25) return true;
+      t = SDL_GetTicks();
+      return !interrupted();
+    });
+  if (stopped) return true;
+
+  drawPreview(preview, f, img);
+  display->setRenderFlag();
+  return ((MyDisplay*)display)->forceUpdate();
+}
+
+//A coarse render of where the drag would go, once per change. Without one (the drag hasn't
+//moved, the view needs an orbit not found yet, or the render was given up), the last render is
+//moved instead.
+void FractalViewer::dragPreview() {
+  const double budget = 0.03; //Seconds
+  const int max_factor = 32;
+  if (scale == drag_scale && nx == drag_x && ny == drag_y) return;
+  drag_scale = scale;
+  drag_x = nx;
+  drag_y = ny;
+  drag_ready = false;
+  if ((mousedown == 1 && scale == 1.0f) || (mousedown == 2 && nx == mx && ny == my)) return;
+
+  HPComplex center, sz;
+  if (mousedown == 1) mandel.zoomedView(scale, my, mx, sc, center, sz);
+  else {
+    for (mpf_class* v : {&center.re, &center.im, &sz.re, &sz.im}) v->set_prec(mandel.precision());
+    center.re = mandel.center.re - (nx - mx) * sc * mandel.sz.re;
+    center.im = mandel.center.im + (ny - my) * sc * mandel.sz.im;
+    sz.re = mandel.sz.re;
+    sz.im = mandel.sz.im;
+  }
+
+  //Given up on, coarser next time, once well over budget or when the mouse has moved on
+  Mandelbrot preview;
+  if (!setupPreview(preview, center, sz, drag_factor)) return;
+  Clock::time_point t = Clock::now();
+  bool finished = preview.computeRows(interactiveThreads(), [&](int) {
+      SDL_PumpEvents();
+      return secondsSince(t) < 4 * budget && !SDL_HasEvents(SDL_MOUSEMOTION, SDL_MOUSEBUTTONUP);
+    });
+  double elapsed = secondsSince(t);
+  if (finished) {
+    drawPreview(preview, drag_factor, drag_img);
+    drag_ready = true;
+    display->setRenderFlag();
+  }
+
+  if (elapsed > budget && drag_factor < max_factor) drag_factor *= 2;
+  else if (elapsed < budget / 8 && drag_factor > 2) drag_factor /= 2;
+}
+
+//Zooms in where the mouse rests, then at the deepest escaping sample. Each guess's orbit is for
+//the deepest zoom a drag there usually reaches, so it serves every zoom in between.
+void FractalViewer::guessNext() {
+  const float deep_scale = 32.0, coarse_scale = 2.0;
+  const int coarse_factor = 4;
+  std::vector<std::pair<int, int>> points; //Pixels, as row and column
+  if (cursor_x >= 0 && cursor_x < img.nc && cursor_y >= 0 && cursor_y < img.nr)
+    points.push_back(std::make_pair(cursor_y, cursor_x));
+
+  int deepest = -1, dr = 0, dc = 0;
+  for (int r = 0; r < mandel.rows(); r++)
+    for (int c = 0; c < mandel.cols(); c++) {
+      int n = mandel.at(r, c).iterations;
+      if (n < mandel.N && n > deepest) {
+	deepest = n;
+	dr = r;
+	dc = c;
       }
     }
+  if (deepest >= 0) points.push_back(std::make_pair(dr / sc, dc / sc));
+
+  std::vector<Speculator::Guess> guesses;
+  HPComplex center, sz;
+  for (auto& pt : points) {
+    Speculator::Guess guess;
+    guess.deep = engine(mandel.rows(), mandel.cols());
+    mandel.zoomedView(deep_scale, pt.first, pt.second, sc, center, sz);
+    guess.deep.setView(center, sz);
+    if (guess.deep.useHardware() || guess.deep.canShare(mandel)) continue; //Ready already
+
+    mandel.zoomedView(coarse_scale, pt.first, pt.second, sc, center, sz);
+    guess.coarse = engine(std::max(img.nr / coarse_factor, 1), std::max(img.nc / coarse_factor, 1));
+    center.re += ((coarse_factor - 1) * sc / 2.0) * sz.re;
+    center.im += ((coarse_factor - 1) * sc / 2.0) * sz.im;
+    sz.re *= coarse_factor * sc;
+    sz.im *= coarse_factor * sc;
+    guess.coarse.setView(center, sz);
+    guesses.push_back(std::move(guess));
   }
+  speculator.guess(std::move(guesses));
+  cursor_guessed = true;
+}
 
-  display->setRenderFlag();
-  return display->forceUpdate();
+//Paints img from a guess's grid, if it covers the whole view, for something to show at once
+bool FractalViewer::drawGuess(const Mandelbrot& coarse) {
+  if (coarse.N != mandel.N || coarse.power != mandel.power) return false;
+
+  //Our sample (r, c) is the guess's (r0 + r * kr, c0 + c * kc), counting fractions
+  mpf_class d(0, mandel.precision());
+  d = (mandel.center.re - coarse.center.re) / coarse.sz.re;
+  double kc = mpf_class(mandel.sz.re / coarse.sz.re).get_d();
+  double c0 = d.get_d() - mandel.cols() / 2 * kc + coarse.cols() / 2;
+  d = (mandel.center.im - coarse.center.im) / coarse.sz.im;
+  double kr = mpf_class(mandel.sz.im / coarse.sz.im).get_d();
+  double r0 = coarse.rows() / 2 - 1 - d.get_d() - (mandel.rows() / 2 - 1) * kr;
+
+  std::vector<int> rows(img.nr), cols(img.nc);
+  for (int r = 0; r < img.nr; r++)
+    if ((rows[r] = (int)floor(r0 + r * sc * kr + 0.5)) < 0 || rows[r] >= coarse.rows()) return false;
+  for (int c = 0; c < img.nc; c++)
+    if ((cols[c] = (int)floor(c0 + c * sc * kc + 0.5)) < 0 || cols[c] >= coarse.cols()) return false;
+
+  Color color;
+  for (int r = 0; r < img.nr; r++)
+    for (int c = 0; c < img.nc; c++) {
+      color = getColor(coarse.at(rows[r], cols[c]));
+      img.at(r, c, 0) = color.r;
+      img.at(r, c, 1) = color.g;
+      img.at(r, c, 2) = color.b;
+    }
+  return true;
 }
 
 void FractalViewer::render() {
   if (mandel.useHardware())
-    display->setTitle("Rendering (hardware arithmetic)...");
+    display->setTitle((std::string("Rendering (") + Mandelbrot::arithmeticName(mandel.arithmetic()) + " arithmetic)...").c_str());
   
+  if (autoflag && !navigating) {
+    mandel.autoN(auto_max_N, interactiveThreads());
+    pal = mw.cache(mandel.N);
+    ((MyDisplay*)display)->print("%d iterations (auto)", mandel.N);
+  }
+  navigating = false;
+
+  //Samples rows r0 to r1 - 1, columns c0 to c1 - 1 are already known from an earlier view
+  int r0 = 0, c0 = 0, r1 = 0, c1 = 0;
+  if (views.restore(mandel, r0, c0, r1, c1) && !r0 && !c0 && r1 == mandel.rows() && c1 == mandel.cols()) {
+    recolor();
+    remember();
+    guessNext();
+    display->setRenderFlag();
+    return;
+  }
+
+  //Guesses were about the last view; one may have this view's orbit, or a grid to show first
+  std::vector<std::shared_ptr<const Speculator::Guess>> guesses = speculator.ready();
+  speculator.forget();
+  for (auto& guess : guesses)
+    if (mandel.offerReference(guess->deep)) break;
   mandel.precompute();
     
-  if (drawlines) img = canvas;
+  if (drawlines) {
+    img = canvas;
+    for (auto& guess : guesses)
+      if (drawGuess(guess->coarse)) {
+	display->setRenderFlag();
+	if (((MyDisplay*)display)->forceUpdate()) return;
+	break;
+      }
+  }
+
+  //Coarse first, refined by halves while nothing else happens
+  for (int f = previewFactor(); f > 1; f /= 2)
+    if (renderPreview(f)) {
+      display->setRenderFlag();
+      return;
+    }
 
+  bool finished = true;
+  long long samples = 0;
+  Clock::time_point start = Clock::now();
   Uint32 t = SDL_GetTicks(), dt;  
   for (int r = 0; r < img.nr; r++) {
-    if (sc == 1) mandel.computeRow(r);
-    else {
-      for (int r1 = r * sc; r1 < (r + 1) * sc; r1++)
-	mandel.computeRow(r1);
+    for (int rs = r * sc; rs < (r + 1) * sc; rs++) {
+      if (mandel.copyMirror(rs)) continue;
+      if (rs < r0 || rs >= r1) {
+	mandel.computeRow(rs);
+	samples += mandel.cols();
+      }
+      else {
+	mandel.computeRow(rs, 0, c0);
+	mandel.computeRow(rs, c1, mandel.cols());
+	samples += mandel.cols() - (c1 - c0);
+      }
     }
     
     if (drawlines) {
       dt = SDL_GetTicks() - t;
       if (dt > 25) {
 	t += dt;
-	if (drawLine(r)) break;
+	if (drawLine(r)) {
+	  finished = false;
+	  break;
+	}
       }
       else colorLine(r);
     }
   }
 
+  if (finished) {
+    if (samples) sample_time = secondsSince(start) / samples;
+    remember();
+    guessNext();
+  }
   display->setRenderFlag();
 }
 
+//Keeps the finished view, and makes it the latest in the history unless it is already where we are
+void FractalViewer::remember() {
+  views.store(mandel);
+
+  ViewCache::View view(mandel);
+  if (history_pos >= 0 && history[history_pos] == view) return;
+  history.resize(history_pos + 1);
+  history.push_back(view);
+  if (history.size() > max_history) history.erase(history.begin());
+  history_pos = history.size() - 1;
+}
+
+void FractalViewer::navigate(int step) {
+  MyDisplay* display = (MyDisplay*)this->display;
+  
+  int pos = history_pos + step;
+  if (pos < 0 || pos >= (int)history.size()) {
+    display->print(step < 0? "No earlier view" : "No later view");
+    return;
+  }
+  history_pos = pos;
+
+  const ViewCache::View& view = history[pos];
+  if (view.nr != img.nr * sc) {
+    mandel.scaleDown(sc);
+    if ((sc = view.nr / img.nr) > 1) mandel.scaleUp(sc);
+  }
+  mandel.N = view.N;
+  mandel.power = view.power;
+  mandel.series_order = view.series_order;
+  mandel.error_tolerance = view.error_tolerance;
+  mandel.setView(view.center, view.sz);
+  pal = mw.cache(mandel.N);
+
+  navigating = renderflag = true;
+  display->print("View %d of %d", pos + 1, (int)history.size());
+}
+
+//Renders what the checkpoint is missing, then saves base.png with its statistics in base.json
+static bool finishBeauty(Checkpoint& checkpoint, Mandelbrot& beauty, const CachedPalette& pal, bool smooth,
+			 const std::string& base, Job& job) {
+  if (!checkpoint.render(beauty, job.threads, [&](int done) {
+	job.setProgress(done, beauty.rows());
+	return !job.cancelled();
+      })) {
+    job.setMessage(job.cancelled()? "Stopped " + base + ".png; press R to resume from " + base + ".ckpt"
+		   : "Could not save to " + base + ".ckpt");
+    return false;
+  }
+
+  int sc = checkpoint.sc;
+  Clock::time_point t = Clock::now();
+  ByteImage out(beauty.rows() / sc, beauty.cols() / sc, 3);
+  {
+    TraceSpan span("recolor");
+    for (int r = 0; r < out.nr; r++)
+      ::colorLine(pal, smooth, beauty, sc, out, r);
+  }
+  beauty.stats.recolor_time = secondsSince(t);
+  {
+    TraceSpan span("savePNG");
+    out.save_filename(base + ".png");
+  }
+  beauty.stats.save((base + ".json").c_str());
+  checkpoint.remove();
+  job.setMessage("Saved render to " + base + ".png");
+  return true;
+}
+
+//At 1920x1080, 3x3 multisampled, checkpointed to base.ckpt as it goes
+void FractalViewer::submitBeauty(const Mandelbrot& view, const std::string& base, int priority) {
+  const int sc = 3, nr = 1080, nc = 1920;
+  HPComplex center = view.center, sz; //Copies keep the view's precision
+  sz.re = view.sz.re * ((double)view.rows() / (nr * sc));
+  sz.im = view.sz.im * ((double)view.rows() / (nr * sc));
+  int N = view.N, power = view.power, series_order = view.series_order;
+  double error_tolerance = view.error_tolerance;
+  std::string reference_cache = view.reference_cache;
+  CachedPalette pal = mw.cache(N);
+  bool smooth = smoothflag;
+
+  //The engine is only made once the job runs, so a long batch holds no grids while it waits
+  watch(jobs.submit(base + ".png", priority, [=](Job& job) {
+	Mandelbrot beauty(nr * sc, nc * sc);
+	beauty.N = N;
+	beauty.power = power;
+	beauty.error_tolerance = error_tolerance;
+	beauty.series_order = series_order;
+	beauty.reference_cache = reference_cache;
+	beauty.setView(center, sz);
+	if (!beauty.precompute([&] {return !job.cancelled();})) {
+	  job.setMessage("Cancelled " + base + ".png");
+	  return false;
+	}
+
+	Checkpoint checkpoint(base + ".ckpt");
+	if (!checkpoint.create(beauty, sc, checkpoint_band)) {
+	  job.setMessage("Could not save to " + base + ".ckpt");
+	  return false;
+	}
+	return finishBeauty(checkpoint, beauty, pal, smooth, base, job);
+      }));
+}
+
 void FractalViewer::beautyRender() {
+  char base[256];
+  sprintf(base, "BR%d", (int)time(NULL));
+  submitBeauty(mandel, base, beauty_priority);
+  ((MyDisplay*)display)->print("Queued beauty render %s", base);
+}
+
+//Picks up a beauty render that was stopped or killed, from its .ckpt directory
+void FractalViewer::resumeBeauty() {
   MyDisplay* display = (MyDisplay*)this->display;
-  display->setTitle("Creating beauty render...");
 
-  Uint32 ticks = SDL_GetTicks();
+  std::string dir;
+  if (!display->getString("Enter a checkpoint to resume:", dir)) return;
+  while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
 
-  int sc = this->sc;
-  Mandelbrot saved = this->mandel;
+  //Only the job is read here, for the palette's N; the rest loads once the job runs
+  Checkpoint saved(dir);
+  if (!saved.loadJob()) {
+    display->print("Could not load from " + dir);
+    return;
+  }
+  CachedPalette pal = mw.cache(saved.job.N);
+  bool smooth = smoothflag;
+  std::string base = dir;
+  if (base.size() > 5 && !base.compare(base.size() - 5, 5, ".ckpt")) base.erase(base.size() - 5);
 
-  this->sc = 3;
-  mandel = Mandelbrot(1080 * this->sc, 1920 * this->sc);
-  mandel.N = saved.N;
-  mandel.center = saved.center;
-  mandel.sz.re = saved.sz.re * ((double)saved.rows() / mandel.rows());
-  mandel.sz.im = saved.sz.im * ((double)saved.rows() / mandel.rows());
+  watch(jobs.submit(base + ".png", beauty_priority, [=](Job& job) {
+	Checkpoint checkpoint(dir);
+	Mandelbrot beauty;
+	if (!checkpoint.resume(beauty)) {
+	  job.setMessage("Could not resume from " + dir);
+	  return false;
+	}
+	return finishBeauty(checkpoint, beauty, pal, smooth, base, job);
+      }));
+  display->print("Queued resuming " + dir);
+}
 
-  mandel.precompute();
+//A beauty render of each location file listed, one per line
+void FractalViewer::batchRender() {
+  MyDisplay* display = (MyDisplay*)this->display;
 
-  display->frameDelay = 0;
+  std::string fn;
+  if (!display->getString("Enter a file listing locations:", fn)) return;
+  FILE* fp = fopen(fn.c_str(), "r");
+  if (!fp) {
+    display->print("Could not load from " + fn);
+    return;
+  }
 
-  Uint32 t = SDL_GetTicks(), dt;
-  
-  bool breakflag = false;
-  for (int r = 0; r < mandel.rows() && !breakflag; r++) {
-    mandel.computeRow(r);
+  char line[4096], base[256];
+  int stamp = (int)time(NULL), queued = 0, missing = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!line[0]) continue;
 
-    display->print("Rendered row %d / %d", r + 1, mandel.rows());
-    
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-      if (event.type == SDL_MOUSEBUTTONDOWN
-	  || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
-	  || (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE)
-	  || event.type == SDL_QUIT) {
-	SDL_PushEvent(&event);
-	breakflag = true;
-	break;
-      }
+    FILE* lfp = fopen(line, "r");
+    if (!lfp) {
+      missing++;
+      continue;
     }
+    fclose(lfp);
 
-    dt = SDL_GetTicks() - t;
-    
-    if (dt > 100) {
-      t += dt;
-      if (display->forceUpdate()) breakflag = true;
-    }
+    Mandelbrot location(img.nr, img.nc);
+    location.error_tolerance = mandel.error_tolerance;
+    location.series_order = mandel.series_order;
+    location.reference_cache = mandel.reference_cache;
+    if (!location.load(line)) location.loadLegacy(line);
+    sprintf(base, "BR%d-%d", stamp, ++queued);
+    submitBeauty(location, base, batch_priority);
   }
+  fclose(fp);
 
-  display->frameDelay = 25;
+  if (missing) display->print("Queued %d renders; could not load %d locations", queued, missing);
+  else display->print("Queued %d renders", queued);
+}
 
-  canvas = img;
-  img = ByteImage(1080, 1920, 3);
-  recolor();
-  
-  char fn[256];
-  sprintf(fn, "BR%d.png", (int)time(NULL));
-  img.save_filename(fn);
-  display->print(OSD_Printer::string("Saved render to %s", fn));
-
-  ticks = SDL_GetTicks() - ticks;
-  char str[256];
-  sprintf(str, "Time: %dms", ticks);
-  display->setTitle(str);
-  
-  img = canvas;
-  mandel = saved;
-  this->sc = sc;  
+void FractalViewer::watch(const std::shared_ptr<Job>& job) {
+  watched.push_back(job);
+  if (jobsflag) display->setRenderFlag();
 }
 
 void FractalViewer::update() {
+  MyDisplay* display = (MyDisplay*)this->display;
   display->frameDelay = 0;
 
-  if (zoomflag) renderflag = true;
-  
+  //Jobs are announced as they end; while the list is up, it refreshes a few times a second
+  for (auto it = watched.begin(); it != watched.end();) {
+    if (!(*it)->finished()) {
+      it++;
+      continue;
+    }
+    std::string message = (*it)->getMessage();
+    display->print(message.empty()? (*it)->describe() : message);
+    it = watched.erase(it);
+    if (jobsflag) display->setRenderFlag();
+  }
+  if (jobsflag && !watched.empty() && SDL_GetTicks() - jobs_shown > 250) {
+    jobs_shown = SDL_GetTicks();
+    display->setRenderFlag();
+  }
+
   if (renderflag) {
     display->setTitle("Rendering...");
     Uint32 ticks = SDL_GetTicks();
@@ -267,33 +648,22 @@ void FractalViewer::update() {
     renderflag = false;
     display->setRenderFlag();
 
-    if (zoomflag) {
-      ByteImage saved = std::move(img);
-      img = ByteImage(saved.nr * 3 / 2, saved.nc * 3 / 2, 3);
-      sc = 2;
-      recolor();
-
-      sprintf(str, "Time: %dms (Rendering video frames)", ticks);
-      display->setTitle(str);
-      zoom.nextFrame(img);
-    
-      img = std::move(saved);
-      sc = 3;
-    
-      mandel.zoom(1.5);
-      mandel.center.re = saved_center.re;
-      mandel.center.im = saved_center.im;
-    }
-    else {
-      sprintf(str, "Time: %dms", ticks);
-      display->setTitle(str);
-    }      
+    sprintf(str, "Time: %dms", ticks);
+    display->setTitle(str);
   }
 
-  if (!mousedown) display->frameDelay = 25;
+  if (mousedown) dragPreview();
+  else {
+    display->frameDelay = 25;
+    if (!cursor_guessed && !renderflag && SDL_GetTicks() - cursor_moved > 250) guessNext(); //Once the mouse rests
+  }
 }
 
-FractalViewer::FractalViewer(WidgetDisplay* display, int h, int w) : Widget(display) {
+FractalViewer::FractalViewer(WidgetDisplay* display, int h, int w)
+  : Widget(display), frame_budget(0.1), sample_time(0.0), drag_ready(false), drag_scale(1.0), drag_x(0), drag_y(0), drag_factor(8),
+    jobs(std::max(1, (int)std::thread::hardware_concurrency() - interactiveThreads())), jobsflag(false),
+    jobs_shown(0), views(view_cache_dir, view_memory, view_disk), history_pos(-1), navigating(false),
+    cursor_x(-1), cursor_y(-1), cursor_moved(0), cursor_guessed(true) {
   canvas = ByteImage(h, w);
   for (int r = 0; r < h; r++)
     for (int c = 0; c < w; c++)
@@ -318,6 +688,8 @@ void FractalViewer::handleKeyEvent(SDL_Event event) {
       renderflag = true;
       display->print("%d iterations", mandel.N);
       break;
+    case SDLK_LEFT: navigate(-1); break;
+    case SDLK_RIGHT: navigate(1); break;
     case SDLK_DOWN:
       if (mandel.N > 256) mandel.N -= 256;
       recolor();
@@ -363,7 +735,29 @@ void FractalViewer::handleKeyEvent(SDL_Event event) {
       break;
     case SDLK_F11: screenshot(); break;
     case SDLK_b:
-      beautyRender();
+      if (SDL_GetModState() & KMOD_SHIFT) batchRender();
+      else beautyRender();
+      break;
+    case SDLK_r: resumeBeauty(); break;
+    case SDLK_j:
+      if (SDL_GetModState() & KMOD_SHIFT) jobs.clearFinished();
+      else jobsflag = !jobsflag;
+      display->setRenderFlag();
+      break;
+    case SDLK_DELETE:
+      if (SDL_GetModState() & KMOD_SHIFT) {
+	jobs.cancelAll();
+	display->print("Cancelled every job");
+      }
+      else {
+	auto list = jobs.list();
+	for (auto it = list.rbegin(); it != list.rend(); it++)
+	  if (!(*it)->finished()) {
+	    (*it)->cancel();
+	    display->print("Cancelled " + (*it)->name);
+	    break;
+	  }
+      }
       break;
     case SDLK_s:
       smoothflag = !smoothflag;
@@ -375,6 +769,39 @@ void FractalViewer::handleKeyEvent(SDL_Event event) {
       drawlines = !drawlines;
       display->print("Draw lines mode: %s", drawlines? "on" : "off");
       break;
+    case SDLK_n:
+      autoflag = !autoflag;
+      display->print("Automatic iterations: %s", autoflag? "on" : "off");
+      if (autoflag) renderflag = true;
+      break;
+    case SDLK_v:
+      if (SDL_GetModState() & KMOD_SHIFT) {
+	if (display->getInt("Frame budget in milliseconds?", n) && n > 0) {
+	  frame_budget = n / 1000.0;
+	  display->print("Frame budget: %dms", n);
+	}
+      }
+      else {
+	dynamicflag = !dynamicflag;
+	display->print("Dynamic resolution: %s", dynamicflag? "on" : "off");
+      }
+      break;
+    case SDLK_o:
+      statsflag = !statsflag;
+      display->setRenderFlag();
+      break;
+    case SDLK_t:
+      if (Trace::enabled()) {
+	char fn[256];
+	sprintf(fn, "trace%d.json", (int)time(NULL));
+	if (Trace::stop(fn)) display->print(OSD_Printer::string("Saved trace to %s", fn));
+	else display->print(OSD_Printer::string("Could not save to %s", fn));
+      }
+      else {
+	Trace::start();
+	display->print("Tracing render phases; press T again to save");
+      }
+      break;
     case SDLK_i:
       if (display->getInt("How many iterations?", n)) {
 	if (n > mandel.N) {
@@ -389,14 +816,35 @@ void FractalViewer::handleKeyEvent(SDL_Event event) {
 	display->print("%d iterations.", mandel.N);
       }
       break;
+    case SDLK_m:
+      mandel.power = (mandel.power < max_power)? mandel.power + 1 : 2;
+      display->print("z -> z^%d + c", mandel.power);
+      renderflag = true;
+      break;
     case SDLK_z:
-      if (!zoomflag) initAutoZoom();
+      zoomVideo();
+      break;
+    case SDLK_x:
+      if (SDL_GetModState() & KMOD_SHIFT) {
+	std::string fn;
+	if (display->getString("Enter an exponential map to encode:", fn)
+	    && display->getInt("Frames per 1.5x zoom?", n))
+	  encodeExpMap(fn.c_str(), n);
+      }
+      else expZoom();
       break;
     case SDLK_e:
       if (display->getDouble("Enter an error tolerance:", d)) {
 	mandel.error_tolerance = d;
 	renderflag = true;
       }
+      break;
+    case SDLK_k:
+      if (display->getInt("How many series terms?", n)) {
+	mandel.series_order = std::min(std::max(n, 2), max_series_order);
+	display->print("%d series terms", mandel.series_order);
+	renderflag = true;
+      }
     }
 }
 
@@ -408,6 +856,12 @@ void FractalViewer::handleEvent(SDL_Event event) {
 	
     if (event.button.button == SDL_BUTTON_RIGHT) mousedown = 2;
     else mousedown = 1;
+    nx = mx;
+    ny = my;
+    drag_scale = 1.0;
+    drag_x = nx;
+    drag_y = ny;
+    drag_ready = false;
   }
   else if (event.type == SDL_MOUSEMOTION) {
     if (mousedown == 1) {
@@ -423,6 +877,12 @@ void FractalViewer::handleEvent(SDL_Event event) {
       ny = event.button.y;
       display->setRenderFlag();
     }
+    else {
+      cursor_x = event.motion.x;
+      cursor_y = event.motion.y;
+      cursor_moved = SDL_GetTicks();
+      cursor_guessed = false;
+    }
   }
   else if (event.type == SDL_MOUSEBUTTONUP && mousedown) {
     if (mousedown == 1) {
@@ -438,22 +898,204 @@ void FractalViewer::handleEvent(SDL_Event event) {
   }
 }
 
-void FractalViewer::initAutoZoom() {
-  zoomflag = true;
-  saved_center.re = mandel.center.re;
-  saved_center.im = mandel.center.im;
-  mandel.sz.re = 4.0 / mandel.cols(); mandel.sz.im = 3.0 / mandel.rows();
+//Keyframes step by 1.5x from the reset view down to this one, 3x3 multisampled, several at a time
+void FractalViewer::zoomVideo() {
+  const int ksc = 3, nr = img.nr, nc = img.nc;
+  HPComplex center = mandel.center, target; //Copies keep the view's precision
+  target.re = mandel.sz.re * ((double)sc / ksc);
+  int N = mandel.N, power = mandel.power, series_order = mandel.series_order;
+  double error_tolerance = mandel.error_tolerance;
+  std::string reference_cache = mandel.reference_cache;
+  CachedPalette pal = mw.cache(N);
+  bool smooth = smoothflag;
 
-  mandel.scaleDown(sc);
-  mandel.scaleUp(sc = 3);
-  
   char fn[256];
   sprintf(fn, "%d.avi", (int)time(NULL));
-  zoom.start(fn, img.nr, img.nc, 45);
+  std::string video = fn;
+
+  watch(jobs.submit(video, video_priority, [=](Job& job) {
+	auto engine = [&](const HPComplex& sz) {
+	  Mandelbrot m(nr * ksc, nc * ksc);
+	  m.N = N;
+	  m.power = power;
+	  m.error_tolerance = error_tolerance;
+	  m.series_order = series_order;
+	  m.reference_cache = reference_cache;
+	  m.setView(center, sz);
+	  return m;
+	};
+
+	HPComplex sz;
+	sz.re = 4.0 / (nc * ksc); sz.im = 3.0 / (nr * ksc);
+	int frames;
+	for (frames = 1; cmp(sz.re, target.re) > 0; frames++) {
+	  sz.re *= (1.0 / 1.5f);
+	  sz.im *= (1.0 / 1.5f);
+	}
+
+	//The deepest keyframe's reference orbit is valid for every shallower one
+	Mandelbrot reference = engine(sz);
+	if (!reference.precompute([&] {return !job.cancelled();})) {
+	  job.setMessage("Cancelled " + video);
+	  return false;
+	}
+	
+	VideoZoom zoom;
+	zoom.start(video, nr, nc, 45);
+	sz.re = 4.0 / (nc * ksc); sz.im = 3.0 / (nr * ksc);
+	
+	//Each keyframe's engine shares the reference orbit and nothing else, so threads don't contend
+	ByteImage last;
+	for (int first = 0; first < frames && !job.cancelled(); first += job.threads) {
+	  std::vector<Mandelbrot> keys;
+	  for (int i = first; i < frames && (int)keys.size() < job.threads; i++) {
+	    keys.push_back(engine(sz));
+	    if (!keys.back().useHardware()) keys.back().setReference(reference);
+	    sz.re *= (1.0 / 1.5f);
+	    sz.im *= (1.0 / 1.5f);
+	  }
+	  
+	  std::vector<std::thread> threads;
+	  for (int i = 0; i < (int)keys.size(); i++)
+	    threads.emplace_back([&, i]() {
+		Mandelbrot& key = keys[i];
+		for (int r = 0; r < key.rows() && !job.cancelled(); r++)
+		  if (!key.copyMirror(r)) key.computeRow(r);
+		if (job.cancelled()) return;
+
+		TraceSpan span("recolor", "frame", first + i);
+		ByteImage frame(nr * 3 / 2, nc * 3 / 2, 3);
+		for (int r = 0; r < frame.nr; r++)
+		  ::colorLine(pal, smooth, key, 2, frame, r);
+		zoom.submit(first + i, std::move(frame));
+	      });
+	  for (auto& thread : threads) thread.join();
+
+	  //Keyframes finish out of order; the video only takes them in sequence
+	  zoom.flush(last);
+	  job.setProgress(first + keys.size(), frames);
+	}
+
+	if (job.cancelled()) return false;
+	job.setMessage("Saved video to " + video);
+	return true;
+      }));
+  ((MyDisplay*)display)->print("Queued zoom video " + video);
+}
+
+//Frames from an exponential map strip at rate per 1.5x zoom, coloured against the strip's own N
+static bool encodeStrip(ExpMap& map, const CachedPalette& pal, bool smooth, int nr, int nc, int rate,
+			const std::string& video, Job& job) {
+  VideoZoom zoom;
+  zoom.start(video, nr, nc, rate);
+  
+  RenderGrid frame(nr, nc);
+  ByteImage out(nr, nc, 3);
+  Color color;
+  double log_start = map.logStart(nr, nc), log_end = map.logEnd();
+  double dlog = log(1.5) / rate;
+  int frames = (int)((log_start - log_end) / dlog) + 1;
+  for (int i = 0; i < frames && !job.cancelled(); i++) {
+    map.frame(log_start - i * dlog, frame);
+    for (int r = 0; r < out.nr; r++)
+      for (int c = 0; c < out.nc; c++) {
+	color = ::getColor(pal, smooth, map.N, frame.at(r, c));
+	out.at(r, c, 0) = color.r;
+	out.at(r, c, 1) = color.g;
+	out.at(r, c, 2) = color.b;
+      }
+    zoom.write(out);
+    job.setProgress(i + 1, frames);
+  }
+
+  return !job.cancelled();
+}
+
+//The strip runs from the reset view down to the current one, then is encoded in the same job
+void FractalViewer::expZoom() {
+  MyDisplay* display = (MyDisplay*)this->display;
+  if (mandel.power != 2) {
+    display->print("Exponential maps are only made for z^2 + c");
+    return;
+  }
+
+  double log_start = log(4.0 / img.nc);
+  double log_end = logOf(mandel.sz.re) + log((double)sc);
+  double radius = 0.5 * sqrt((double)img.nr * img.nr + (double)img.nc * img.nc) + 1.0;
+  int cols = sc * (int)ceil(2.0 * 3.14159265358979 * radius);
+  HPComplex center = mandel.center;
+  int N = mandel.N, nr = img.nr, nc = img.nc;
+  CachedPalette pal = mw.cache(N);
+  bool smooth = smoothflag;
+
+  char fn[256];
+  int stamp = (int)time(NULL);
+  sprintf(fn, "%d.exp", stamp);
+  std::string strip = fn;
+  sprintf(fn, "%d.avi", stamp);
+  std::string video = fn;
+
+  watch(jobs.submit(strip, video_priority, [=](Job& job) {
+	ExpMap map(center, N, cols, log_start + log(radius), log_end + log(0.5));
+	if (!map.create(strip.c_str())) {
+	  job.setMessage("Could not save to " + strip);
+	  return false;
+	}
+
+	while (!job.cancelled() && map.renderBand())
+	  job.setProgress(map.rowsDone(), map.nr);
+	map.close();
+	if (job.cancelled()) {
+	  job.setMessage("Exponential map stopped; partial strip in " + strip);
+	  return false;
+	}
+
+	if (!map.open(strip.c_str())) {
+	  job.setMessage("Could not load from " + strip);
+	  return false;
+	}
+	bool ok = encodeStrip(map, pal, smooth, nr, nc, 45, video, job);
+	job.setMessage(ok? "Saved video to " + video : "Stopped encoding " + video);
+	return ok;
+      }));
+  display->print("Queued exponential map " + strip);
+}
+
+void FractalViewer::encodeExpMap(const char* fn, int rate) {
+  MyDisplay* display = (MyDisplay*)this->display;
+
+  //Opened here only to check it and find its N for the palette
+  ExpMap map;
+  if (!map.open(fn) || rate < 1) {
+    display->print("Could not load from %s", fn);
+    return;
+  }
+  CachedPalette pal = mw.cache(map.N);
+  map.close();
+  
+  std::string strip = fn;
+  int nr = img.nr, nc = img.nc;
+  bool smooth = smoothflag;
+  char vfn[256];
+  sprintf(vfn, "%d.avi", (int)time(NULL));
+  std::string video = vfn;
+
+  watch(jobs.submit(video, video_priority, [=](Job& job) {
+	ExpMap map;
+	if (!map.open(strip.c_str())) {
+	  job.setMessage("Could not load from " + strip);
+	  return false;
+	}
+	bool ok = encodeStrip(map, pal, smooth, nr, nc, rate, video, job);
+	job.setMessage(ok? "Saved video to " + video : "Stopped encoding " + video);
+	return ok;
+      }));
+  display->print("Queued encoding of " + strip);
 }
 
 void FractalViewer::render(ByteImage& canvas, int x, int y) {
-  if (mousedown == 1){
+  if (mousedown && drag_ready) this->canvas = drag_img;
+  else if (mousedown == 1){
     this->canvas.fill(255);
     this->canvas.blitSampled(img, scale, scale, my - scale * my, mx - scale * mx);
   }
@@ -466,4 +1108,47 @@ void FractalViewer::render(ByteImage& canvas, int x, int y) {
   }
 
   canvas.blit(this->canvas, y, x);
+  if (statsflag) drawStats(canvas, x, y);
+  if (jobsflag) drawJobs(canvas, x, y);
+}
+
+void FractalViewer::drawStats(ByteImage& canvas, int x, int y) {
+  MyDisplay* display = (MyDisplay*)this->display;
+  TextRenderer* font = display->editor->getFont();
+  std::vector<std::string> lines = mandel.stats.describe();
+  const int line_height = 16;
+
+  //Darkened band behind the text
+  int nr = std::min(line_height * (int)lines.size() + line_height / 2, img.nr);
+  for (int r = y; r < y + nr; r++)
+    for (int c = x; c < x + img.nc; c++)
+      for (int ch = 0; ch < canvas.nchannels; ch++)
+	canvas.at(r, c, ch) /= 3;
+  
+  for (int i = 0; i < lines.size(); i++)
+    font->drawCentered(canvas, lines[i].c_str(), y + line_height * i + line_height / 2 + 4, x + img.nc / 2, 255, 255, 255);
+}
+
+void FractalViewer::drawJobs(ByteImage& canvas, int x, int y) {
+  MyDisplay* display = (MyDisplay*)this->display;
+  TextRenderer* font = display->editor->getFont();
+  std::vector<std::string> lines;
+  for (auto& job : jobs.list())
+    lines.push_back(job->describe());
+  if (lines.empty()) lines.push_back("No background jobs");
+  lines.push_back("Delete cancels the newest job, Shift+Delete every job; Shift+J clears finished");
+  const int line_height = 16;
+
+  //Darkened band along the bottom, newest jobs last
+  int nr = std::min(line_height * (int)lines.size() + line_height / 2, img.nr);
+  int top = y + img.nr - nr;
+  for (int r = top; r < y + img.nr; r++)
+    for (int c = x; c < x + img.nc; c++)
+      for (int ch = 0; ch < canvas.nchannels; ch++)
+	canvas.at(r, c, ch) /= 3;
+
+  int first = std::max(0, (int)lines.size() - nr / line_height);
+  for (int i = first; i < lines.size(); i++)
+    font->drawCentered(canvas, lines[i].c_str(), top + line_height * (i - first) + line_height / 2 + 4, x + img.nc / 2,
+		       255, 255, 255);
 }
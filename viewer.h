@@ -2,6 +2,11 @@
 #define _BPJ_NEWMAN_VIEWER_H
 
 #include "mandelbrot.h"
+#include "jobs.h"
+#include "viewcache.h"
+#include "speculate.h"
+#include "expmap.h"
+#include "colorize.h"
 #include "multiwave.h"
 #include "video.h"
 #include <byteimage/osd.h>
@@ -20,11 +25,12 @@ protected:
   bool renderflag; //Requires recomputation
   bool drawlines;  //This forces progress display
   bool smoothflag; //Smooth coloring
-  bool zoomflag;   //Constant zoom
+  bool statsflag;  //Statistics overlay
+  bool autoflag;   //Choose N before each render
+  bool dynamicflag; //Show coarse previews first when a render would miss the frame budget
 
-  //For autozoom
-  HPComplex saved_center;
-  VideoZoom zoom;
+  double frame_budget; //Seconds for the first preview
+  double sample_time;  //Seconds per sample of the last finished render, on one thread
 
   //Numerical results of latest render
   Mandelbrot mandel;
@@ -40,6 +46,31 @@ protected:
   //For interactive movement
   int mousedown, mx, my, nx, ny;
   float scale;
+
+  //Live preview of the view a drag would give
+  ByteImage drag_img;
+  bool drag_ready;
+  float drag_scale;
+  int drag_x, drag_y;
+  int drag_factor; //Pixels per side of each sample, adjusted to keep within the frame
+
+  //Beauty renders, batches and videos, behind the view
+  JobQueue jobs;
+  std::vector<std::shared_ptr<Job>> watched; //Announced when they finish
+  bool jobsflag; //Job list overlay
+  Uint32 jobs_shown;
+
+  //Views rendered before, for going back and forth without rendering again
+  ViewCache views;
+  std::vector<ViewCache::View> history;
+  int history_pos;
+  bool navigating; //Showing a view from history, whose iterations stay as they were
+
+  //Orbits and coarse grids for where the next view is likely to be, found while idle
+  Speculator speculator;
+  int cursor_x, cursor_y; //Where the mouse rests, or -1 if unknown
+  Uint32 cursor_moved;
+  bool cursor_guessed;
   
   void save();
   void load();
@@ -49,14 +80,34 @@ protected:
   void updatePalette();
   void reset();
 
-  void initAutoZoom();
+  void zoomVideo();
+  void expZoom();
+  void encodeExpMap(const char* fn, int rate);
   
   void recolor();
   Color getColor(const RenderGrid::EscapeValue& escape);
   void colorLine(int r);
+  bool interrupted();
   bool drawLine(int r);
+  int previewFactor() const;
+  Mandelbrot engine(int nr, int nc) const; //With this view's settings
+  bool shareReference(Mandelbrot& engine);
+  bool setupPreview(Mandelbrot& preview, const HPComplex& center, const HPComplex& sz, int f);
+  void drawPreview(const Mandelbrot& preview, int f, ByteImage& out);
+  bool renderPreview(int f);
+  void dragPreview();
+  void guessNext();
+  bool drawGuess(const Mandelbrot& coarse);
   void render();
+  void remember();
+  void navigate(int step);
+  void submitBeauty(const Mandelbrot& view, const std::string& base, int priority);
   void beautyRender();
+  void resumeBeauty();
+  void batchRender();
+  void watch(const std::shared_ptr<Job>& job);
+  void drawStats(ByteImage& canvas, int x, int y);
+  void drawJobs(ByteImage& canvas, int x, int y);
 
   void update();
   